@@ -0,0 +1 @@
+#define MAX_HEAP (100*(1<<20))
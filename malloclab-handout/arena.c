@@ -0,0 +1,215 @@
+/*
+ * arena.c - region allocator layered on mm_malloc
+ *
+ * An arena hands out memory by bumping a pointer through large chunks
+ * that it gets from mm_malloc. Objects carry no header and cannot be
+ * freed one by one; instead arena_reset releases everything allocated
+ * from the arena at once and arena_destroy releases the arena itself.
+ * Both walk the chunk list, so they cost O(chunks) however many objects
+ * were allocated.
+ *
+ *    arena
+ *  +--------+     +------+-----------------------+
+ *  | chunks |---->| next | obj | obj | obj | ... |  <- top, end
+ *  | top    |     +------+-----------------------+
+ *  | end    |        |
+ *  +--------+        v
+ *                 +------+-----------------------------+
+ *                 | next | obj | obj | ...   (full)    |
+ *                 +------+-----------------------------+
+ *
+ * The head of the list is the chunk being bumped through. A request too
+ * big to share a chunk gets a chunk of its own, linked in behind the head
+ * so that the head keeps serving small requests.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mm.h"
+#include "arena.h"
+
+// Alignment of every object handed out (bytes), as for mm_malloc
+static const size_t arena_align = 16;
+
+// Chunk size used when arena_create is passed 0 (bytes)
+static const size_t default_chunk_size = (1 << 15);
+
+/*
+ * Chunk header, padded to arena_align bytes so that the data after it
+ * keeps the alignment of the mm_malloc payload
+ */
+typedef struct chunk chunk_t;
+
+struct chunk
+{
+    chunk_t *next;
+    size_t size;    // bytes of data after the header
+};
+
+struct arena
+{
+    chunk_t *chunks;     // head is the chunk being bumped through
+    char *top;           // next free byte in the head chunk
+    char *end;           // end of the head chunk
+    size_t chunk_size;   // data bytes in a regular chunk
+};
+
+/* Function prototypes for internal helper routines */
+
+static size_t round_up(size_t size, size_t n);
+static char *chunk_data(chunk_t *chunk);
+static chunk_t *chunk_new(size_t size);
+
+/*
+ * arena_create - Create an empty arena that grows in chunks of
+ * chunk_size bytes (a default size if 0). Returns NULL if out of memory.
+ */
+arena_t *arena_create(size_t chunk_size)
+{
+    arena_t *arena = mm_malloc(sizeof(arena_t));
+
+    if (arena == NULL)
+        return NULL;
+
+    if (chunk_size == 0)
+        chunk_size = default_chunk_size;
+
+    arena->chunks = NULL;
+    arena->top = arena->end = NULL;
+    arena->chunk_size = round_up(chunk_size, arena_align);
+
+    return arena;
+}
+
+/*
+ * arena_alloc - Allocate size bytes, aligned like mm_malloc, that live
+ * until the arena is reset or destroyed. Returns NULL if size is 0 or out
+ * of memory.
+ */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    if (size == 0 || size > SIZE_MAX - arena_align)
+        return NULL;
+
+    size = round_up(size, arena_align);
+
+    // Fast path: bump the pointer
+    if (size <= (size_t) (arena->end - arena->top)) {
+        void *bp = arena->top;
+        arena->top += size;
+        return bp;
+    }
+
+    // A request bigger than a quarter chunk would waste too much of a
+    // fresh one, so it gets a chunk of its own behind the head
+    if (size > arena->chunk_size / 4) {
+        chunk_t *chunk = chunk_new(size);
+        if (chunk == NULL)
+            return NULL;
+
+        if (arena->chunks == NULL) {
+            chunk->next = NULL;
+            arena->chunks = chunk;
+            arena->top = arena->end = chunk_data(chunk) + size;
+        } else {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        }
+        return chunk_data(chunk);
+    }
+
+    // Start a new head chunk; what is left of the old one is wasted
+    chunk_t *chunk = chunk_new(arena->chunk_size);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->top = chunk_data(chunk) + size;
+    arena->end = chunk_data(chunk) + chunk->size;
+
+    return chunk_data(chunk);
+}
+
+/*
+ * arena_reset - Release everything allocated from the arena. The head
+ * chunk is kept for the next round of allocations if it is a regular
+ * chunk; all others go back to mm_free.
+ */
+void arena_reset(arena_t *arena)
+{
+    chunk_t *keep = arena->chunks;
+
+    if (keep != NULL && keep->size != arena->chunk_size)
+        keep = NULL;
+
+    chunk_t *chunk = arena->chunks;
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        if (chunk != keep)
+            mm_free(chunk);
+        chunk = next;
+    }
+
+    if (keep == NULL) {
+        arena->chunks = NULL;
+        arena->top = arena->end = NULL;
+    } else {
+        keep->next = NULL;
+        arena->chunks = keep;
+        arena->top = chunk_data(keep);
+        arena->end = chunk_data(keep) + keep->size;
+    }
+}
+
+/*
+ * arena_destroy - Release the arena and everything allocated from it
+ */
+void arena_destroy(arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+
+    chunk_t *chunk = arena->chunks;
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        mm_free(chunk);
+        chunk = next;
+    }
+
+    mm_free(arena);
+}
+
+/*
+ * chunk_new - Get a chunk with size bytes of data from mm_malloc. The
+ * caller links it in.
+ */
+static chunk_t *chunk_new(size_t size)
+{
+    if (size > SIZE_MAX - arena_align)
+        return NULL;
+
+    chunk_t *chunk = mm_malloc(arena_align + size);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->size = size;
+    return chunk;
+}
+
+/*
+ * chunk_data: returns the first data byte of a chunk, right after its
+ *             padded header.
+ */
+static char *chunk_data(chunk_t *chunk)
+{
+    return (char *) chunk + arena_align;
+}
+
+/*
+ * round_up: Rounds size up to next multiple of n
+ */
+static size_t round_up(size_t size, size_t n)
+{
+    return n * ((size + (n-1)) / n);
+}
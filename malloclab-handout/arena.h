@@ -0,0 +1,11 @@
+/*
+ * arena.h - interface to the region allocator in arena.c
+ */
+#include <stddef.h>
+
+typedef struct arena arena_t;
+
+extern arena_t *arena_create(size_t chunk_size);
+extern void *arena_alloc(arena_t *arena, size_t size);
+extern void arena_reset(arena_t *arena);
+extern void arena_destroy(arena_t *arena);
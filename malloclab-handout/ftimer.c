@@ -7,11 +7,42 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_sample: version that times each run on its own with a
+ *                   nanosecond clock and returns statistics over the runs
+ *
+ * ftimer_sample reads CLOCK_MONOTONIC_RAW by default. Compiled with
+ * -DFTIMER_RDTSC on x86 it reads the time-stamp counter instead, scaled
+ * to seconds with a rate measured once against CLOCK_MONOTONIC_RAW; this
+ * assumes an invariant TSC, as on any recent x86 CPU.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
 #include <sys/time.h>
 #include "ftimer.h"
 
+#if defined(FTIMER_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define USE_RDTSC
+#endif
+
+/* Untimed runs made before sampling, to warm up caches and the heap */
+#ifndef FTIMER_WARMUP
+#define FTIMER_WARMUP 2
+#endif
+
+/* Number of fastest runs averaged into the K-best estimate */
+#ifndef FTIMER_KBEST
+#define FTIMER_KBEST 3
+#endif
+
+/* Runs further than this many (scaled) median absolute deviations above
+   the median are rejected as outliers, e.g. runs hit by a context switch */
+#ifndef FTIMER_OUTLIER_K
+#define FTIMER_OUTLIER_K 5.0
+#endif
+
 /* function prototypes */
 static void init_etime(void);
 static double get_etime(void);
@@ -50,6 +81,122 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n) {
     return (1E-3*diff);
 }
 
+/*
+ * ftimer_now - Return the current time in seconds from an arbitrary
+ * origin, with nanosecond resolution or better
+ */
+#ifdef USE_RDTSC
+static double tsc_period;   /* seconds per TSC tick */
+
+static double clock_raw(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + 1E-9*ts.tv_nsec;
+}
+
+double ftimer_now(void) {
+    if (tsc_period == 0) {
+        double start = clock_raw(), end;
+        unsigned long long tsc = __rdtsc();
+
+        while ((end = clock_raw()) - start < 1E-2)
+            ;
+        tsc_period = (end - start) / (double)(__rdtsc() - tsc);
+    }
+    return tsc_period * (double)__rdtsc();
+}
+#else
+double ftimer_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + 1E-9*ts.tv_nsec;
+}
+#endif
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* value at fraction q of the sorted array t[0..n-1] */
+static double percentile(const double *t, int n, double q) {
+    int i = (int)(q * (n - 1) + 0.5);
+
+    return t[i];
+}
+
+/*
+ * ftimer_sample - Time f(argp) over n runs (n >= 1) after FTIMER_WARMUP
+ * untimed ones, timing every run on its own. If setup is not NULL,
+ * setup(argp) runs before each run, outside the timed region. Runs far
+ * above the median are rejected as outliers, and the rest are summarized
+ * in *stats if it is not NULL. Return the median run time. Exits with
+ * a message if n is below 1 or the run times cannot be allocated.
+ */
+double ftimer_sample(ftimer_test_funct setup, ftimer_test_funct f, void *argp, int n,
+                     ftimer_stats_t *stats) {
+    double *t, median, *dev, mad, sum = 0, sumsq = 0;
+    int i, kept;
+    ftimer_stats_t s;
+
+    if (n < 1) {
+        fprintf(stderr, "ftimer_sample: need at least one run\n");
+        exit(1);
+    }
+    if ((t = malloc(2 * n * sizeof(double))) == NULL) {
+        fprintf(stderr, "ftimer_sample: malloc error\n");
+        exit(1);
+    }
+    dev = t + n;
+
+    for (i = 0; i < FTIMER_WARMUP; i++) {
+        if (setup != NULL)
+            setup(argp);
+        f(argp);
+    }
+    ftimer_now();   /* calibrate before the first timed run */
+    for (i = 0; i < n; i++) {
+        if (setup != NULL)
+            setup(argp);
+        double start = ftimer_now();
+        f(argp);
+        t[i] = ftimer_now() - start;
+    }
+    qsort(t, n, sizeof(double), compare_doubles);
+    median = percentile(t, n, 0.5);
+
+    /* 1.4826 * MAD estimates the standard deviation of normal noise
+       without being thrown off by the outliers themselves */
+    for (i = 0; i < n; i++)
+        dev[i] = fabs(t[i] - median);
+    qsort(dev, n, sizeof(double), compare_doubles);
+    mad = 1.4826 * percentile(dev, n, 0.5);
+    for (kept = n; kept > 1 && t[kept-1] - median > FTIMER_OUTLIER_K * mad; kept--)
+        ;
+
+    s.n = kept;
+    s.rejected = n - kept;
+    s.min = t[0];
+    s.median = percentile(t, kept, 0.5);
+    s.p99 = percentile(t, kept, 0.99);
+    for (i = 0; i < kept; i++) {
+        sum += t[i];
+        sumsq += t[i] * t[i];
+    }
+    s.mean = sum / kept;
+    s.stddev = kept > 1 ? sqrt(fmax(0, (sumsq - sum * s.mean) / (kept - 1))) : 0;
+    for (sum = 0, i = 0; i < kept && i < FTIMER_KBEST; i++)
+        sum += t[i];
+    s.kbest = sum / i;
+
+    free(t);
+    if (stats != NULL)
+        *stats = s;
+    return s.median;
+}
 
 /*
  * Routines for manipulating the Unix interval timer
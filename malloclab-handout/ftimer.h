@@ -0,0 +1,22 @@
+/*
+ * ftimer.h - interface to the function timers in ftimer.c
+ */
+typedef void (*ftimer_test_funct)(void *);
+
+/* Summary of the per-run times (in seconds) collected by ftimer_sample */
+typedef struct {
+    int n;          /* runs kept after outlier rejection */
+    int rejected;   /* runs dropped as outliers */
+    double min;
+    double median;
+    double p99;
+    double mean;
+    double stddev;
+    double kbest;   /* mean of the FTIMER_KBEST fastest runs */
+} ftimer_stats_t;
+
+double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
+double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
+double ftimer_now(void);
+double ftimer_sample(ftimer_test_funct setup, ftimer_test_funct f, void *argp, int n,
+                     ftimer_stats_t *stats);
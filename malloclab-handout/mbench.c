@@ -0,0 +1,1131 @@
+/*
+ * mbench.c - trace-driven benchmark for the mm.c allocator
+ *
+ * Replays allocation traces against mm_init/mm_malloc/mm_realloc/mm_free,
+ * and against the C library's malloc as a baseline. For each trace and
+ * allocator it reports throughput (ops/sec over the median of NUM_RUNS
+ * runs, each on a heap emptied with mem_reset_brk before its timing
+ * starts, with the run-to-run standard deviation as a percentage), peak
+ * utilization (max live payload divided by the peak heap size; mm.c
+ * only) and the latency of single ops in nanoseconds (median, 99th and
+ * 99.9th percentile, max).
+ *
+ * Traces use the usual malloclab format: four header lines (suggested heap
+ * size, number of ids, number of ops, weight) followed by one op per line:
+ *
+ *      a <id> <bytes>      allocate
+ *      r <id> <bytes>      reallocate
+ *      f <id>              free
+ *
+ * With no trace files on the command line, a set of built-in synthetic
+ * traces is generated instead; "ping-pong" repeatedly frees a block and
+ * allocates the same size again, the pattern that deferred coalescing
+ * (-DMM_DEFER_COALESCE) is meant for.
+ *
+ * A burst test then compares allocating and freeing 256 objects at a time
+ * with one mm_malloc/mm_free call per object against mm_malloc_batch and
+ * mm_free_batch, and an object-cache test compares mm_malloc/mm_free
+ * with a slab cache for small fixed-size objects. An arena test compares
+ * freeing a round of short-lived objects one by one against allocating
+ * them from an arena (see arena.c) that is reset after each round.
+ *
+ * Last, a cold-heap test replays one trace on a fresh memlib region for
+ * each backing that mem_init_backing offers (calloc, a private mapping,
+ * transparent huge pages, prefaulting), to show what page faults do to
+ * the latency tail.
+ *
+ * "-c <level>" runs mm.c with heap checking at that level (see
+ * mm_check_level), to measure what the checks cost.
+ *
+ * "-r <file>" adds a restart test: a heap of small objects is built in
+ * the heap file (see mem_init_file), checkpointed and closed, then
+ * reopened and attached with mm_attach. The time to build it is compared
+ * with the time to attach, and to attach and read every object back.
+ *
+ * "-p" prints the heap profile (see mm_profile_dump) of each trace to
+ * stderr as JSON, taken when the heap last grew. Building with
+ * -DMM_PROFILE adds the sampled request counters to it.
+ *
+ * When the allocator is built with -DMM_THREADS, "-t <n>" also runs a
+ * scaling test: 1, 2, 4, ... up to n threads each replay their own
+ * synthetic trace at the same time, and the combined ops/sec is reported.
+ * A handoff test follows, in which half of the threads allocate buffers
+ * and pass them through a ring to the other half, which free them.
+ *
+ * To compare the segregated lists against the single explicit list, build
+ * the allocator both ways and run the same traces:
+ *
+ *      gcc -O2 -o mbench mbench.c mm.c slab.c arena.c memlib.c ftimer.c -lm
+ *      gcc -O2 -DMM_NUM_CLASSES=1 -DMM_TREE_MIN_SIZE=0 -o mbench-single \
+ *          mbench.c mm.c slab.c arena.c memlib.c ftimer.c -lm
+ *      gcc -O2 -DMM_THREADS -pthread -o mbench-mt \
+ *          mbench.c mm.c slab.c arena.c memlib.c ftimer.c -lm
+ *
+ * Placement policies are compared the same way, building once per policy
+ * with -DMM_FIT_POLICY=FIT_FIRST, FIT_NEXT or FIT_BEST (and optionally
+ * -DMM_BEST_FIT_K=<k>). The heap column is the peak heap size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "mm.h"
+#include "memlib.h"
+#include "ftimer.h"
+#include "slab.h"
+#include "arena.h"
+
+/* Number of timed runs sampled per trace */
+#define NUM_RUNS 11
+
+/* Placement policy the allocator was built with, for the report header */
+#define STRINGIFY(x) #x
+#define POLICY_NAME(x) STRINGIFY(x)
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY FIT_BEST
+#endif
+
+typedef enum { ALLOC, FREE, REALLOC } op_type_t;
+
+typedef struct {
+    op_type_t type;   /* type of request */
+    int index;        /* id of the block the request refers to */
+    size_t size;      /* byte size of alloc/realloc request */
+} trace_op_t;
+
+typedef struct {
+    char name[64];
+    int num_ids;
+    int num_ops;
+    trace_op_t *ops;
+    void **blocks;    /* block pointers, indexed by id */
+} trace_t;
+
+/* Simple xorshift generator so synthetic traces are reproducible */
+static unsigned long long rand_state = 0x2545F4914F6CDD1DULL;
+
+static unsigned long long next_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static trace_t *alloc_trace(const char *name, int num_ids, int num_ops)
+{
+    trace_t *trace = calloc(1, sizeof(trace_t));
+    if (trace == NULL) {
+        fprintf(stderr, "mbench: out of memory\n");
+        exit(1);
+    }
+    snprintf(trace->name, sizeof(trace->name), "%s", name);
+    trace->num_ids = num_ids;
+    trace->num_ops = num_ops;
+    trace->ops = calloc(num_ops, sizeof(trace_op_t));
+    trace->blocks = calloc(num_ids, sizeof(void *));
+    if (trace->ops == NULL || trace->blocks == NULL) {
+        fprintf(stderr, "mbench: out of memory\n");
+        exit(1);
+    }
+    return trace;
+}
+
+static void free_trace(trace_t *trace)
+{
+    free(trace->ops);
+    free(trace->blocks);
+    free(trace);
+}
+
+/*
+ * read_trace - Parse a malloclab trace file
+ */
+static trace_t *read_trace(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    int heap_size, num_ids, num_ops, weight;
+    char type[8];
+
+    if (fp == NULL) {
+        fprintf(stderr, "mbench: could not open %s\n", filename);
+        exit(1);
+    }
+    if (fscanf(fp, "%d %d %d %d", &heap_size, &num_ids, &num_ops, &weight) != 4) {
+        fprintf(stderr, "mbench: bad header in %s\n", filename);
+        exit(1);
+    }
+
+    const char *base = strrchr(filename, '/');
+    trace_t *trace = alloc_trace(base ? base + 1 : filename, num_ids, num_ops);
+
+    int n = 0;
+    while (n < num_ops && fscanf(fp, "%7s", type) == 1) {
+        trace_op_t *op = &trace->ops[n];
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            op->type = (type[0] == 'a') ? ALLOC : REALLOC;
+            if (fscanf(fp, "%d %zu", &op->index, &op->size) != 2)
+                goto bad;
+            break;
+        case 'f':
+            op->type = FREE;
+            if (fscanf(fp, "%d", &op->index) != 1)
+                goto bad;
+            break;
+        default:
+            goto bad;
+        }
+        if (op->index < 0 || op->index >= num_ids)
+            goto bad;
+        n++;
+    }
+    trace->num_ops = n;
+    fclose(fp);
+    return trace;
+
+bad:
+    fprintf(stderr, "mbench: bad op %d in %s\n", n, filename);
+    exit(1);
+}
+
+/*
+ * synth_trace - Generate a trace that keeps up to num_ids blocks live,
+ * with request sizes drawn between min_size and max_size. Each op frees a
+ * random live block or allocates a missing one, which leaves a heap full
+ * of holes of mixed sizes.
+ */
+static trace_t *synth_trace(const char *name, int num_ids, int num_ops,
+                            size_t min_size, size_t max_size)
+{
+    trace_t *trace = alloc_trace(name, num_ids, num_ops);
+    char *live = calloc(num_ids, 1);
+    int n = 0;
+
+    while (n < num_ops) {
+        int index = next_rand() % num_ids;
+        trace_op_t *op = &trace->ops[n++];
+        op->index = index;
+        if (live[index]) {
+            op->type = FREE;
+            live[index] = 0;
+        } else {
+            op->type = ALLOC;
+            op->size = min_size + next_rand() % (max_size - min_size + 1);
+            live[index] = 1;
+        }
+    }
+
+    /* Free everything that is still live, so the trace is balanced */
+    trace->ops = realloc(trace->ops, (num_ops + num_ids) * sizeof(trace_op_t));
+    for (int i = 0; i < num_ids; i++) {
+        if (live[i]) {
+            trace->ops[n].type = FREE;
+            trace->ops[n].index = i;
+            n++;
+        }
+    }
+    trace->num_ops = n;
+    free(live);
+    return trace;
+}
+
+/*
+ * pingpong_trace - Generate a trace that allocates num_ids blocks with
+ * sizes between min_size and max_size, then over and over frees a random
+ * one and allocates the same size again, and finally frees everything
+ */
+static trace_t *pingpong_trace(const char *name, int num_ids, int num_pairs,
+                               size_t min_size, size_t max_size)
+{
+    trace_t *trace = alloc_trace(name, num_ids, 2 * num_ids + 2 * num_pairs);
+    size_t *sizes = calloc(num_ids, sizeof(size_t));
+    int n = 0;
+
+    for (int i = 0; i < num_ids; i++) {
+        sizes[i] = min_size + next_rand() % (max_size - min_size + 1);
+        trace->ops[n++] = (trace_op_t) { ALLOC, i, sizes[i] };
+    }
+    for (int i = 0; i < num_pairs; i++) {
+        int index = next_rand() % num_ids;
+        trace->ops[n++] = (trace_op_t) { FREE, index, 0 };
+        trace->ops[n++] = (trace_op_t) { ALLOC, index, sizes[index] };
+    }
+    for (int i = 0; i < num_ids; i++)
+        trace->ops[n++] = (trace_op_t) { FREE, i, 0 };
+
+    free(sizes);
+    return trace;
+}
+
+/*
+ * Allocators the traces are replayed against: mm.c on the simulated heap,
+ * and the C library's malloc as a baseline
+ */
+typedef struct {
+    const char *name;
+    void (*reset)(void);   /* start from an empty heap */
+    void *(*malloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    bool has_heap;         /* whether mem_heapsize() measures its heap */
+} allocator_t;
+
+static void mm_reset(void)
+{
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mbench: mm_init failed\n");
+        exit(1);
+    }
+}
+
+static void libc_reset(void)
+{
+}
+
+/*
+ * mm_setup - Empty the mm.c heap before a timed run. Used as the ftimer
+ * setup function, so the reset is not part of the time.
+ */
+static void mm_setup(void *arg)
+{
+    (void) arg;
+    mm_reset();
+}
+
+static const allocator_t allocators[] = {
+    { "mm",   mm_reset,   mm_malloc, mm_realloc, mm_free, true },
+    { "libc", libc_reset, malloc,    realloc,    free,    false },
+};
+
+/* Allocator used by replay and replay_ops */
+static const allocator_t *cur_alloc = &allocators[0];
+
+/* Whether to dump the mm heap profile of each trace ("-p") */
+static bool profile = false;
+
+/*
+ * replay_ops - Run every op of the trace against the current heap
+ */
+static void *replay_ops(void *arg)
+{
+    trace_t *trace = arg;
+    const allocator_t *alloc = cur_alloc;
+
+    for (int i = 0; i < trace->num_ops; i++) {
+        trace_op_t *op = &trace->ops[i];
+        switch (op->type) {
+        case ALLOC:
+            trace->blocks[op->index] = alloc->malloc(op->size);
+            break;
+        case REALLOC:
+            trace->blocks[op->index] = alloc->realloc(trace->blocks[op->index], op->size);
+            break;
+        case FREE:
+            alloc->free(trace->blocks[op->index]);
+            trace->blocks[op->index] = NULL;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * release_blocks - Free whatever an unbalanced trace left allocated. The
+ * simulated heap is simply reset, but libc needs every block back.
+ */
+static void release_blocks(trace_t *trace)
+{
+    for (int i = 0; i < trace->num_ids; i++) {
+        if (trace->blocks[i] != NULL && !cur_alloc->has_heap)
+            cur_alloc->free(trace->blocks[i]);
+        trace->blocks[i] = NULL;
+    }
+}
+
+/*
+ * replay_setup - Give the current allocator an empty heap. Used as the
+ * ftimer setup function for replay.
+ */
+static void replay_setup(void *arg)
+{
+    (void) arg;
+    cur_alloc->reset();
+}
+
+/*
+ * replay - Run every op of the trace against the heap that replay_setup
+ * emptied. Used directly as the ftimer test function.
+ */
+static void replay(void *arg)
+{
+    replay_ops(arg);
+    release_blocks(arg);
+}
+
+typedef struct {
+    double util;         /* peak payload / peak heap size */
+    size_t peak_heap;    /* peak heap size (bytes) */
+    double p50, p99, p999, max;   /* per-op latency (ns) */
+} stats_t;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * measure - Replay the trace once, timing every op on its own and
+ * tracking live payload and heap size, to fill in the stats that the
+ * timed runs cannot collect without slowing down.
+ */
+static void measure(trace_t *trace, stats_t *stats)
+{
+    size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+    double *latency = malloc(trace->num_ops * sizeof(double));
+    size_t live = 0, peak = 0;
+    const allocator_t *alloc = cur_alloc;
+
+    if (sizes == NULL || latency == NULL) {
+        fprintf(stderr, "mbench: out of memory\n");
+        exit(1);
+    }
+
+    // With -p, the profile is captured each time the heap reaches a new
+    // peak, so what is printed is the heap as it was when it last grew
+    char *prof_buf = NULL;
+    size_t prof_len = 0;
+
+    stats->peak_heap = 0;
+    alloc->reset();
+
+    for (int i = 0; i < trace->num_ops; i++) {
+        trace_op_t *op = &trace->ops[i];
+        void **bp = &trace->blocks[op->index];
+        double start = now_ns();
+
+        switch (op->type) {
+        case ALLOC:
+            *bp = alloc->malloc(op->size);
+            latency[i] = now_ns() - start;
+            live += op->size;
+            sizes[op->index] = op->size;
+            break;
+        case REALLOC:
+            *bp = alloc->realloc(*bp, op->size);
+            latency[i] = now_ns() - start;
+            live += op->size - sizes[op->index];
+            sizes[op->index] = op->size;
+            break;
+        case FREE:
+            alloc->free(*bp);
+            latency[i] = now_ns() - start;
+            *bp = NULL;
+            live -= sizes[op->index];
+            sizes[op->index] = 0;
+            break;
+        }
+        if (live > peak)
+            peak = live;
+        if (alloc->has_heap && mem_heapsize() > stats->peak_heap) {
+            stats->peak_heap = mem_heapsize();
+            if (profile) {
+                FILE *fp = open_memstream(&prof_buf, &prof_len);
+                if (fp != NULL) {
+                    mm_profile_dump(fp);
+                    fclose(fp);
+                }
+            }
+        }
+    }
+    release_blocks(trace);
+
+    if (prof_buf != NULL) {
+        fprintf(stderr, "%s: profile at peak heap\n%s", trace->name, prof_buf);
+        free(prof_buf);
+    }
+
+    qsort(latency, trace->num_ops, sizeof(double), compare_doubles);
+    stats->p50 = latency[trace->num_ops / 2];
+    stats->p99 = latency[(size_t) (trace->num_ops * 0.99)];
+    stats->p999 = latency[(size_t) (trace->num_ops * 0.999)];
+    stats->max = latency[trace->num_ops - 1];
+    stats->util = stats->peak_heap ? (double) peak / (double) stats->peak_heap : 0;
+
+    free(latency);
+    free(sizes);
+}
+
+static void print_header(void)
+{
+    printf("%-16s %-5s %8s %11s %6s %7s %10s %7s %7s %7s %8s\n", "trace", "alloc",
+           "ops", "ops/sec", "+/-", "util", "heap", "p50", "p99", "p99.9", "max");
+}
+
+static void run_trace(trace_t *trace)
+{
+    if (trace->num_ops == 0)
+        return;
+
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        stats_t stats;
+        ftimer_stats_t runs;
+
+        cur_alloc = &allocators[i];
+        double secs = ftimer_sample(replay_setup, replay, trace, NUM_RUNS, &runs);
+        measure(trace, &stats);
+
+        printf("%-16s %-5s %8d %11.0f %5.1f%% ", trace->name, cur_alloc->name,
+               trace->num_ops, trace->num_ops / secs, 100.0 * runs.stddev / runs.median);
+        if (cur_alloc->has_heap)
+            printf("%6.1f%% %10zu ", 100.0 * stats.util, stats.peak_heap);
+        else
+            printf("%7s %10s ", "-", "-");
+        printf("%7.0f %7.0f %7.0f %8.0f\n", stats.p50, stats.p99, stats.p999, stats.max);
+    }
+    cur_alloc = &allocators[0];
+}
+
+/*
+ * Burst test for mm_malloc_batch/mm_free_batch: each round allocates
+ * batch_size objects of one size and then frees them all, either one call
+ * per object or one batch call each way
+ */
+typedef struct {
+    size_t size;
+    void *ptrs[256];
+    int rounds;
+} burst_t;
+
+static void burst_single(void *arg)
+{
+    burst_t *b = arg;
+
+    for (int r = 0; r < b->rounds; r++) {
+        for (size_t i = 0; i < 256; i++)
+            b->ptrs[i] = mm_malloc(b->size);
+        for (size_t i = 0; i < 256; i++)
+            mm_free(b->ptrs[i]);
+    }
+}
+
+static void burst_batch(void *arg)
+{
+    burst_t *b = arg;
+
+    for (int r = 0; r < b->rounds; r++) {
+        mm_malloc_batch(b->size, b->ptrs, 256);
+        mm_free_batch(b->ptrs, 256);
+    }
+}
+
+/*
+ * run_bursts - Report per-call and batched throughput for bursts of 256
+ * objects of a few sizes
+ */
+static void run_bursts(void)
+{
+    static const size_t sizes[] = { 8, 48, 200, 1000 };
+    burst_t b;
+
+    printf("\n%-16s %12s %12s %9s\n", "burst of 256", "per-call", "batched", "speedup");
+
+    b.rounds = 400;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double ops = 2.0 * 256 * b.rounds;
+
+        b.size = sizes[i];
+        double single = ops / ftimer_sample(mm_setup, burst_single, &b, NUM_RUNS, NULL);
+        double batch = ops / ftimer_sample(mm_setup, burst_batch, &b, NUM_RUNS, NULL);
+        printf("%-16zu %12.0f %12.0f %8.2fx\n", sizes[i], single, batch, batch / single);
+    }
+}
+
+/*
+ * Object-cache test: each round allocates num_objs objects of one size,
+ * frees every other one, allocates those again and then frees them all,
+ * once through mm_malloc/mm_free and once through a slab cache
+ */
+typedef struct {
+    size_t size;
+    slab_cache_t *cache;
+    void *objs[4096];
+    int rounds;
+} objects_t;
+
+static void objects_mm(void *arg)
+{
+    objects_t *o = arg;
+
+    for (int r = 0; r < o->rounds; r++) {
+        for (int i = 0; i < 4096; i++)
+            o->objs[i] = mm_malloc(o->size);
+        for (int i = 1; i < 4096; i += 2)
+            mm_free(o->objs[i]);
+        for (int i = 1; i < 4096; i += 2)
+            o->objs[i] = mm_malloc(o->size);
+        for (int i = 0; i < 4096; i++)
+            mm_free(o->objs[i]);
+    }
+}
+
+static void objects_slab(void *arg)
+{
+    objects_t *o = arg;
+
+    o->cache = slab_cache_create(o->size);
+    for (int r = 0; r < o->rounds; r++) {
+        for (int i = 0; i < 4096; i++)
+            o->objs[i] = slab_alloc(o->cache);
+        for (int i = 1; i < 4096; i += 2)
+            slab_free(o->cache, o->objs[i]);
+        for (int i = 1; i < 4096; i += 2)
+            o->objs[i] = slab_alloc(o->cache);
+        for (int i = 0; i < 4096; i++)
+            slab_free(o->cache, o->objs[i]);
+    }
+    slab_cache_destroy(o->cache);
+}
+
+/*
+ * run_objects - Report mm_malloc and slab cache throughput for a few
+ * small object sizes, along with the memory each needs for 4096 objects
+ */
+static void run_objects(void)
+{
+    static const size_t sizes[] = { 16, 24, 40, 100 };
+    objects_t o;
+
+    printf("\n%-16s %12s %12s %9s %10s %10s\n", "4096 objects", "mm_malloc",
+           "slab", "speedup", "mm bytes", "slab bytes");
+
+    o.rounds = 50;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double ops = 4.0 * 4096 * o.rounds;
+        slab_stats_t stats;
+
+        o.size = sizes[i];
+        double mm = ops / ftimer_sample(mm_setup, objects_mm, &o, NUM_RUNS, NULL);
+        double slab = ops / ftimer_sample(mm_setup, objects_slab, &o, NUM_RUNS, NULL);
+
+        // Footprint of one full set of objects
+        mm_reset();
+        size_t heap = mem_heapsize();
+        for (int j = 0; j < 4096; j++)
+            o.objs[j] = mm_malloc(o.size);
+        heap = mem_heapsize() - heap;
+        o.cache = slab_cache_create(o.size);
+        for (int j = 0; j < 4096; j++)
+            slab_alloc(o.cache);
+        slab_cache_stats(o.cache, &stats);
+        slab_cache_destroy(o.cache);
+
+        printf("%-16zu %12.0f %12.0f %8.2fx %10zu %10zu\n", sizes[i], mm, slab,
+               slab / mm, heap, stats.bytes);
+    }
+}
+
+/*
+ * Arena test: each round allocates 4096 objects of 16 to 256 bytes, with
+ * every 64th one too big to share a chunk, and then releases them all,
+ * once through mm_malloc/mm_free and once through an arena that is reset
+ * after each round and destroyed at the end
+ */
+typedef struct {
+    size_t sizes[4096];
+    void *objs[4096];
+    int rounds;
+} arena_run_t;
+
+static void arena_mm(void *arg)
+{
+    arena_run_t *a = arg;
+
+    for (int r = 0; r < a->rounds; r++) {
+        for (int i = 0; i < 4096; i++) {
+            a->objs[i] = mm_malloc(a->sizes[i]);
+            *(char *) a->objs[i] = (char) i;
+        }
+        for (int i = 0; i < 4096; i++)
+            mm_free(a->objs[i]);
+    }
+}
+
+static void arena_region(void *arg)
+{
+    arena_run_t *a = arg;
+
+    arena_t *arena = arena_create(0);
+    for (int r = 0; r < a->rounds; r++) {
+        for (int i = 0; i < 4096; i++) {
+            a->objs[i] = arena_alloc(arena, a->sizes[i]);
+            *(char *) a->objs[i] = (char) i;
+        }
+        arena_reset(arena);
+    }
+    arena_destroy(arena);
+}
+
+/*
+ * run_arena - Report how many objects per second mm_malloc/mm_free and an
+ * arena get through, along with the heap each needs for one round. The
+ * arena's is taken over two rounds with a reset in between, which should
+ * cost nothing extra. The objects of the second round are checked to have
+ * kept their contents, and the heap to trim back to its starting size
+ * once the arena is destroyed.
+ */
+static void run_arena(void)
+{
+    arena_run_t *a = malloc(sizeof(arena_run_t));
+
+    if (a == NULL) {
+        fprintf(stderr, "mbench: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < 4096; i++)
+        a->sizes[i] = (i % 64 == 63) ? 12000 : 16 + next_rand() % 241;
+
+    printf("\n%-16s %12s %12s %9s %10s %10s\n", "4096 objects", "mm_malloc",
+           "arena", "speedup", "mm bytes", "arena bytes");
+
+    a->rounds = 50;
+    double objs = 4096.0 * a->rounds;
+    double mm = objs / ftimer_sample(mm_setup, arena_mm, a, NUM_RUNS, NULL);
+    double arena = objs / ftimer_sample(mm_setup, arena_region, a, NUM_RUNS, NULL);
+
+    // Footprint of one round of objects
+    mm_reset();
+    size_t heap = mem_heapsize();
+    for (int i = 0; i < 4096; i++)
+        a->objs[i] = mm_malloc(a->sizes[i]);
+    heap = mem_heapsize() - heap;
+
+    mm_reset();
+    size_t start = mem_heapsize();
+    arena_t *ar = arena_create(0);
+    for (int r = 0; r < 2; r++) {
+        if (r > 0)
+            arena_reset(ar);
+        for (int i = 0; i < 4096; i++) {
+            a->objs[i] = arena_alloc(ar, a->sizes[i]);
+            if (a->objs[i] == NULL) {
+                fprintf(stderr, "mbench: arena_alloc failed\n");
+                exit(1);
+            }
+            memset(a->objs[i], i, a->sizes[i]);
+        }
+    }
+    size_t region = mem_heapsize() - start;
+    for (int i = 0; i < 4096; i++) {
+        unsigned char *obj = a->objs[i];
+        for (size_t j = 0; j < a->sizes[i]; j++) {
+            if (obj[j] != (unsigned char) i) {
+                fprintf(stderr, "mbench: arena object %d was overwritten\n", i);
+                exit(1);
+            }
+        }
+    }
+    arena_destroy(ar);
+
+    // Everything went back, so the heap trims down to where it started
+    mm_trim(0);
+    if (mem_heapsize() > start) {
+        fprintf(stderr, "mbench: arena_destroy left chunks behind\n");
+        exit(1);
+    }
+
+    printf("%-16s %12.0f %12.0f %8.2fx %10zu %10zu\n", "16-256, 12000", mm, arena,
+           arena / mm, heap, region);
+    free(a);
+}
+
+/*
+ * run_backing - Replay a trace once on a freshly initialized memlib
+ * region for each way of backing it, and report how long the setup took
+ * and the latency of single ops. On a cold region every first touch of a
+ * page faults, which shows up in the latency tail.
+ */
+static void run_backing(trace_t *trace)
+{
+    static const struct { const char *name; int flags; } backings[] = {
+        { "calloc", 0 },
+        { "mmap", MEM_MMAP },
+        { "mmap+huge", MEM_MMAP | MEM_HUGEPAGE },
+        { "mmap+populate", MEM_MMAP | MEM_POPULATE },
+        { "mmap+huge+pop", MEM_MMAP | MEM_HUGEPAGE | MEM_POPULATE },
+    };
+
+    printf("\n%-16s %10s %7s %7s %7s %8s   (cold %s heap)\n", "backing",
+           "init ms", "p50", "p99", "p99.9", "max", trace->name);
+
+    cur_alloc = &allocators[0];
+    for (size_t i = 0; i < sizeof(backings) / sizeof(backings[0]); i++) {
+        stats_t stats;
+
+        mem_deinit();
+        double start = now_ns();
+        mem_init_backing(backings[i].flags);
+        double init = now_ns() - start;
+        measure(trace, &stats);
+
+        printf("%-16s %10.2f %7.0f %7.0f %7.0f %8.0f\n", backings[i].name, init / 1e6,
+               stats.p50, stats.p99, stats.p999, stats.max);
+    }
+
+    mem_deinit();
+    mem_init();
+}
+
+/*
+ * Objects built for the restart test, and where its heap file is mapped.
+ * Pointers to the objects are kept in chunks of RESTART_CHUNK, small
+ * enough that the chunks come from the heap, and so from the file, rather
+ * than from an mmap of their own that mm_attach would not bring back.
+ */
+#define RESTART_OBJECTS 500000
+#define RESTART_CHUNK 512
+#define RESTART_CHUNKS ((RESTART_OBJECTS + RESTART_CHUNK - 1) / RESTART_CHUNK)
+#define RESTART_BASE ((void *) 0x600000000000ULL)
+
+/*
+ * restart_open - Open the heap file, returning what mem_init_file does
+ */
+static int restart_open(const char *path)
+{
+    int result = mem_init_file(path, RESTART_BASE);
+    if (result < 0)
+        exit(1);
+    return result;
+}
+
+/*
+ * in_heap_file - Return true if the size bytes at p lie in the heap file
+ */
+static bool in_heap_file(void *p, size_t size)
+{
+    return (char *) p >= (char *) mem_heap_lo()
+        && (char *) p + size - 1 <= (char *) mem_heap_hi();
+}
+
+/*
+ * run_restart - Time building a heap of small objects in a heap file
+ * against resuming it with mm_attach after the file was closed. The file
+ * was just written, so reading the objects back hits the page cache.
+ */
+static void run_restart(const char *path)
+{
+    void ***chunks;
+    unsigned long long sum = 0, expect = 0;
+
+    // A file left by an earlier run is resumed and thrown away
+    mem_deinit();
+    restart_open(path);
+    mm_reset();
+
+    double start = now_ns();
+    chunks = mm_malloc(RESTART_CHUNKS * sizeof(void **));
+    for (int i = 0; i < RESTART_OBJECTS; i++) {
+        if (i % RESTART_CHUNK == 0)
+            chunks[i / RESTART_CHUNK] = mm_malloc(RESTART_CHUNK * sizeof(void *));
+        size_t size = 16 + next_rand() % 240;
+        void *bp = mm_malloc(size);
+        memset(bp, i, size);
+        chunks[i / RESTART_CHUNK][i % RESTART_CHUNK] = bp;
+        expect += (unsigned char) i;
+    }
+    double build = now_ns() - start;
+
+    if (mm_checkpoint() < 0) {
+        fprintf(stderr, "mbench: mm_checkpoint failed\n");
+        exit(1);
+    }
+    mem_deinit();
+
+    start = now_ns();
+    if (restart_open(path) != 1 || mm_attach() < 0) {
+        fprintf(stderr, "mbench: cannot attach to %s\n", path);
+        exit(1);
+    }
+    double attach = now_ns() - start;
+
+    // The file is mapped at the same address, so the pointer to the chunk
+    // array kept across the restart still finds it; everything read from
+    // here on must come from the file
+    if (!in_heap_file(chunks, RESTART_CHUNKS * sizeof(void **))) {
+        fprintf(stderr, "mbench: restart roots are not in %s\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < RESTART_OBJECTS; i++) {
+        void **chunk = chunks[i / RESTART_CHUNK];
+        if (i % RESTART_CHUNK == 0 && !in_heap_file(chunk, RESTART_CHUNK * sizeof(void *))) {
+            fprintf(stderr, "mbench: restart roots are not in %s\n", path);
+            exit(1);
+        }
+        sum += *(unsigned char *) chunk[i % RESTART_CHUNK];
+    }
+    double read = now_ns() - start;
+
+    if (sum != expect) {
+        fprintf(stderr, "mbench: checksum %llu after restart, expected %llu\n", sum, expect);
+        exit(1);
+    }
+
+    printf("\n%-20s %10s   (%d objects, checksum %llu)\n", "restart", "ms",
+           RESTART_OBJECTS, sum);
+    printf("%-20s %10.2f\n", "build", build / 1e6);
+    printf("%-20s %10.2f\n", "attach", attach / 1e6);
+    printf("%-20s %10.2f\n", "attach+read", read / 1e6);
+
+    mem_deinit();
+    mem_init();
+}
+
+#ifdef MM_THREADS
+typedef struct {
+    int num_threads;
+    trace_t **traces;
+} parallel_t;
+
+/*
+ * replay_parallel - Start one thread per trace on the heap that mm_setup
+ * emptied and wait for all of them. Used as the ftimer test function.
+ */
+static void replay_parallel(void *arg)
+{
+    parallel_t *par = arg;
+    pthread_t tids[par->num_threads];
+
+    for (int i = 0; i < par->num_threads; i++)
+        pthread_create(&tids[i], NULL, replay_ops, par->traces[i]);
+    for (int i = 0; i < par->num_threads; i++)
+        pthread_join(tids[i], NULL);
+}
+
+/*
+ * run_scaling - Report combined throughput for 1, 2, 4, ... max_threads
+ * threads, each replaying its own copy of a small-object trace
+ */
+static void run_scaling(int max_threads)
+{
+    trace_t *traces[max_threads];
+    parallel_t par = { 0, traces };
+
+    for (int i = 0; i < max_threads; i++)
+        traces[i] = synth_trace("mt-small-churn", 5000, 200000, 1, 128);
+
+    printf("\n%-20s %10s %12s %10s\n", "threads", "ops", "ops/sec", "speedup");
+
+    double base = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        par.num_threads = n;
+        int ops = n * traces[0]->num_ops;
+        double rate = ops / ftimer_sample(mm_setup, replay_parallel, &par, NUM_RUNS, NULL);
+        if (n == 1)
+            base = rate;
+        printf("%-20d %10d %12.0f %9.2fx\n", n, ops, rate, rate / base);
+    }
+
+    for (int i = 0; i < max_threads; i++)
+        free_trace(traces[i]);
+}
+
+/* Buffers each producer hands to its consumer per run */
+#define HANDOFF_ITEMS 200000
+#define HANDOFF_RING 256
+
+typedef struct {
+    void *slot[HANDOFF_RING];
+    unsigned long head;    /* buffers produced so far */
+    unsigned long tail;    /* buffers consumed so far */
+    const allocator_t *alloc;
+} handoff_t;
+
+typedef struct {
+    int num_pairs;
+    handoff_t *rings;
+} handoff_run_t;
+
+static void *handoff_producer(void *arg)
+{
+    handoff_t *ring = arg;
+    unsigned long long state = (uintptr_t) ring | 1;
+
+    for (unsigned long i = 0; i < HANDOFF_ITEMS; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        void *bp = ring->alloc->malloc(16 + state % 240);
+
+        while (i - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= HANDOFF_RING)
+            sched_yield();
+        ring->slot[i % HANDOFF_RING] = bp;
+        __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *handoff_consumer(void *arg)
+{
+    handoff_t *ring = arg;
+
+    for (unsigned long i = 0; i < HANDOFF_ITEMS; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) <= i)
+            sched_yield();
+        ring->alloc->free(ring->slot[i % HANDOFF_RING]);
+        __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * handoff_setup - Give the allocator of the pairs an empty heap. Used as
+ * the ftimer setup function for replay_handoff.
+ */
+static void handoff_setup(void *arg)
+{
+    handoff_run_t *run = arg;
+
+    run->rings[0].alloc->reset();
+}
+
+/*
+ * replay_handoff - Run num_pairs producer/consumer pairs on the heap that
+ * handoff_setup emptied. Used as the ftimer test function.
+ */
+static void replay_handoff(void *arg)
+{
+    handoff_run_t *run = arg;
+    pthread_t tids[2 * run->num_pairs];
+
+    for (int i = 0; i < run->num_pairs; i++) {
+        run->rings[i].head = run->rings[i].tail = 0;
+        pthread_create(&tids[2 * i], NULL, handoff_producer, &run->rings[i]);
+        pthread_create(&tids[2 * i + 1], NULL, handoff_consumer, &run->rings[i]);
+    }
+    for (int i = 0; i < 2 * run->num_pairs; i++)
+        pthread_join(tids[i], NULL);
+}
+
+/*
+ * run_handoff - Report throughput for 1, 2, ... max_threads / 2 pairs of
+ * threads, one allocating buffers of 16 to 255 bytes and the other
+ * freeing them
+ */
+static void run_handoff(int max_threads)
+{
+    handoff_t rings[max_threads / 2 + 1];
+    handoff_run_t run = { 0, rings };
+
+    printf("\n%-20s %-5s %10s %12s\n", "handoff pairs", "alloc", "ops", "ops/sec");
+
+    for (int n = 1; n <= max_threads / 2; n *= 2) {
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+            for (int i = 0; i < n; i++)
+                rings[i].alloc = &allocators[a];
+            run.num_pairs = n;
+
+            int ops = 2 * n * HANDOFF_ITEMS;
+            double rate = ops / ftimer_sample(handoff_setup, replay_handoff, &run, NUM_RUNS, NULL);
+            printf("%-20d %-5s %10d %12.0f\n", n, allocators[a].name, ops, rate);
+        }
+    }
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    int max_threads = 0;
+    const char *restart_file = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "c:pr:t:")) != -1) {
+        switch (c) {
+        case 'c':
+            mm_check_level(atoi(optarg));
+            break;
+        case 'p':
+            profile = true;
+            break;
+        case 'r':
+            restart_file = optarg;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c level] [-p] [-r heapfile] [-t threads] [tracefile...]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+#ifndef MM_THREADS
+    if (max_threads > 0) {
+        fprintf(stderr, "mbench: -t needs an allocator built with -DMM_THREADS\n");
+        exit(1);
+    }
+#endif
+
+    mem_init();
+
+    printf("policy: %s\n", POLICY_NAME(MM_FIT_POLICY));
+    print_header();
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            trace_t *trace = read_trace(argv[i]);
+            run_trace(trace);
+            free_trace(trace);
+        }
+    } else {
+        trace_t *traces[] = {
+            synth_trace("tiny-churn", 20000, 200000, 8, 24),
+            synth_trace("small-churn", 20000, 200000, 1, 64),
+            synth_trace("mixed-churn", 20000, 200000, 1, 4096),
+            synth_trace("large-churn", 2000, 20000, 4096, 65536),
+            pingpong_trace("ping-pong", 5000, 100000, 1, 200),
+        };
+        for (size_t i = 0; i < sizeof(traces) / sizeof(traces[0]); i++) {
+            run_trace(traces[i]);
+            free_trace(traces[i]);
+        }
+    }
+
+    run_bursts();
+    run_objects();
+    run_arena();
+
+    trace_t *cold = synth_trace("large-churn", 2000, 20000, 4096, 65536);
+    run_backing(cold);
+    free_trace(cold);
+
+    if (restart_file != NULL)
+        run_restart(restart_file);
+
+#ifdef MM_THREADS
+    if (max_threads > 0) {
+        run_scaling(max_threads);
+        run_handoff(max_threads);
+    }
+#endif
+
+    mem_deinit();
+    return 0;
+}
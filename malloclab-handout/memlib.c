@@ -8,81 +8,362 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* private functions */
+static void mem_release(mem_region_t *r, char *lo, char *hi);
+
+/* alignment of an mmap backing region, so that it can use huge pages */
+#define HUGE_PAGE_SIZE (1 << 21)
+
+/* "memlib01", marking the first page of a heap file */
+#define MEM_FILE_MAGIC 0x313062696c6d656dULL
+
+/* metadata in the page of a heap file just below the heap */
+typedef struct {
+  uint64_t magic;
+  uint64_t max_heap;        /* MAX_HEAP of the program that wrote it */
+  uint64_t base;            /* address the heap was mapped at */
+  uint64_t brk;             /* heap size when it was closed */
+  uint64_t clean;           /* set by mem_deinit, cleared while open */
+  unsigned char user[MEM_USER_AREA];
+} mem_file_t;
+
+/* one simulated heap */
+struct mem_region {
+  char *start_brk;           /* points to first byte of heap */
+  char *brk;                 /* points to last byte of heap */
+  char *max_addr;            /* largest legal heap address */
+  char *dirty;               /* [brk, dirty) may be nonzero after a reset */
+  char *map_start;           /* mapping holding the heap, NULL if calloc'd */
+  size_t map_len;            /* length of that mapping */
+  mem_file_t *file;          /* metadata of a file-backed heap, else NULL */
+};
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */
+static mem_region_t mem_default;  /* the heap of mem_init and mem_sbrk */
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
-  /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-    fprintf(stderr, "mem_init_vm: malloc error\n");
-    exit(1);
+  mem_init_backing(0);
+}
+
+/*
+ * mem_init_backing - initialize the memory system model, choosing how the
+ *    storage is backed. With no flags it comes from calloc. Any of
+ *    MEM_MMAP, MEM_HUGEPAGE or MEM_POPULATE gives the heap a mapping of its
+ *    own, aligned to a huge page; MEM_HUGEPAGE then asks for transparent
+ *    huge pages with madvise(MADV_HUGEPAGE), and MEM_POPULATE prefaults
+ *    the whole region (with MAP_POPULATE, or by touching each huge page)
+ *    so that heap accesses do not fault.
+ */
+void mem_init_backing(int flags) {
+  mem_region_t *r = &mem_default;
+
+  r->map_start = NULL;
+  r->file = NULL;
+
+  if (flags == 0) {
+    /* allocate the storage we will use to model the available VM; like
+       fresh pages from the OS, it starts out zero-filled */
+    if ((r->start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
+      fprintf(stderr, "mem_init_vm: malloc error\n");
+      exit(1);
+    }
+  } else {
+    /* map a huge page more than needed so the heap can start on one */
+    r->map_len = MAX_HEAP + HUGE_PAGE_SIZE;
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    /* without huge pages the kernel can prefault at mmap time */
+    if ((flags & MEM_POPULATE) && !(flags & MEM_HUGEPAGE))
+      map_flags |= MAP_POPULATE;
+
+    r->map_start = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+    if (r->map_start == MAP_FAILED) {
+      fprintf(stderr, "mem_init_vm: mmap error\n");
+      exit(1);
+    }
+    r->start_brk = (char *)(((uintptr_t)r->map_start + HUGE_PAGE_SIZE - 1)
+                             & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+    if ((flags & MEM_HUGEPAGE) && madvise(r->start_brk, MAX_HEAP, MADV_HUGEPAGE) != 0)
+      fprintf(stderr, "mem_init_vm: madvise(MADV_HUGEPAGE) failed, using normal pages\n");
+
+    /* with huge pages, prefault only after the madvise so that the faults
+       get huge pages, by touching one byte of each */
+    if ((flags & MEM_POPULATE) && (flags & MEM_HUGEPAGE)) {
+      for (size_t i = 0; i < MAX_HEAP; i += HUGE_PAGE_SIZE)
+        r->start_brk[i] = 0;
+    }
+  }
+
+  r->max_addr = r->start_brk + MAX_HEAP;  /* max legal heap address */
+  r->brk = r->start_brk;                  /* heap is empty initially */
+  r->dirty = r->start_brk;
+}
+
+/*
+ * mem_init_file - initialize the memory system model with the heap kept
+ *    in the file at path, mapped shared at the fixed address base (page
+ *    aligned) with one page of metadata right below it. If the file holds
+ *    a heap that was closed with mem_deinit by a program with the same
+ *    MAX_HEAP and base, the heap is picked up where it was left and 1 is
+ *    returned, so the allocator can attach to it; only the pages that are
+ *    touched get read back in. Otherwise the file is emptied, the heap
+ *    starts out empty and 0 is returned. Returns -1 if the file cannot be
+ *    opened or base is taken.
+ */
+int mem_init_file(const char *path, void *base) {
+  mem_region_t *r = &mem_default;
+  size_t page = mem_pagesize();
+  size_t len = page + MAX_HEAP;
+  mem_file_t old;
+  int resume = 0;
+
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "mem_init_file: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  /* a heap left open, by a crash, may be in any state */
+  if (pread(fd, &old, sizeof(old), 0) == sizeof(old) && old.magic == MEM_FILE_MAGIC
+      && old.clean && old.max_heap == MAX_HEAP && old.base == (uintptr_t)base
+      && old.brk <= MAX_HEAP)
+    resume = 1;
+
+  /* a new heap must read as zero, so any old contents are dropped */
+  if ((!resume && ftruncate(fd, 0) != 0) || ftruncate(fd, len) != 0) {
+    fprintf(stderr, "mem_init_file: cannot size %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  char *map = mmap((char *)base - page, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED || map != (char *)base - page) {
+    if (map != MAP_FAILED)
+      munmap(map, len);
+    fprintf(stderr, "mem_init_file: cannot map %s at %p\n", path, base);
+    return -1;
+  }
+
+  r->map_start = map;
+  r->map_len = len;
+  r->file = (mem_file_t *)map;
+  r->file->magic = MEM_FILE_MAGIC;
+  r->file->max_heap = MAX_HEAP;
+  r->file->base = (uintptr_t)base;
+  r->file->clean = 0;
+  if (!resume) {
+    r->file->brk = 0;
+    memset(r->file->user, 0, MEM_USER_AREA);
+  }
+
+  r->start_brk = (char *)base;
+  r->max_addr = r->start_brk + MAX_HEAP;
+  r->brk = r->start_brk + r->file->brk;
+  r->dirty = r->brk;
+  return resume;
+}
+
+/*
+ * mem_default_region - return the region that mem_init set up, which
+ *    mem_sbrk and the other functions without a region argument work on
+ */
+mem_region_t *mem_default_region(void) {
+  return &mem_default;
+}
+
+/*
+ * mem_region_create - map a region of its own for an extra heap, with
+ *    room for size bytes (rounded up to a page). Pages are only backed
+ *    once touched. Returns NULL if the mapping fails.
+ */
+mem_region_t *mem_region_create(size_t size) {
+  mem_region_t *r = calloc(1, sizeof(mem_region_t));
+  if (r == NULL)
+    return NULL;
+
+  r->map_len = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+  r->map_start = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (r->map_start == MAP_FAILED) {
+    free(r);
+    return NULL;
   }
 
-  mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-  mem_brk = mem_start_brk;                  /* heap is empty initially */
+  r->start_brk = r->map_start;
+  r->max_addr = r->start_brk + r->map_len;
+  r->brk = r->start_brk;
+  r->dirty = r->start_brk;
+  return r;
+}
+
+/*
+ * mem_region_destroy - unmap a region made by mem_region_create, with
+ *    everything in it
+ */
+void mem_region_destroy(mem_region_t *r) {
+  munmap(r->map_start, r->map_len);
+  free(r);
+}
+
+/*
+ * mem_region_user_area - return the MEM_USER_AREA bytes of the heap
+ *    file's metadata page that the allocator may use to find its way back
+ *    into the heap, or NULL if the region is not file-backed
+ */
+void *mem_region_user_area(mem_region_t *r) {
+  return r->file != NULL ? r->file->user : NULL;
 }
 
 /* 
- * mem_deinit - free the storage used by the memory system model
+ * mem_deinit - free the storage used by the memory system model. A heap
+ *    file is written back and marked as closed cleanly, with its size.
  */
 void mem_deinit(void) {
-  free(mem_start_brk);
+  mem_region_t *r = &mem_default;
+
+  if (r->file != NULL) {
+    r->file->brk = r->brk - r->start_brk;
+    msync(r->map_start, r->map_len, MS_SYNC);
+    r->file->clean = 1;
+    msync(r->file, mem_pagesize(), MS_SYNC);
+    munmap(r->map_start, r->map_len);
+    r->file = NULL;
+  } else if (r->map_start != NULL)
+    munmap(r->map_start, r->map_len);
+  else
+    free(r->start_brk);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    The old heap is not cleared here; mem_sbrk clears each part of it
+ *    as it hands it out again, so memory above the brk still reads as
+ *    zero-filled, as it would for pages newly mapped by the OS.
  */
 void mem_reset_brk() {
-  mem_brk = mem_start_brk;
+  mem_region_t *r = &mem_default;
+
+  if (r->brk > r->dirty)
+    r->dirty = r->brk;
+  r->brk = r->start_brk;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, and the released memory is handed
+ *    back as described in mem_release. The brk is moved with a
+ *    compare-and-swap, so concurrent callers each get their own area.
  */
-void *mem_sbrk(size_t incr) {
-  char *old_brk = mem_brk;
+void *mem_sbrk(intptr_t incr) {
+  return mem_region_sbrk(&mem_default, incr);
+}
 
-  if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ) {
-    errno = ENOMEM;
-    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-    return (void *)-1;
-  }
-  mem_brk += incr;
+/*
+ * mem_region_sbrk - mem_sbrk for the heap in region r
+ */
+void *mem_region_sbrk(mem_region_t *r, intptr_t incr) {
+  char *old_brk = __atomic_load_n(&r->brk, __ATOMIC_ACQUIRE);
+
+  do {
+    if (incr < 0 && (old_brk - r->start_brk) < -incr) {
+      errno = EINVAL;
+      fprintf(stderr, "ERROR: mem_sbrk failed. Cannot shrink below the heap start...\n");
+      return (void *)-1;
+    }
+    if ( incr > 0 && (old_brk + incr) > r->max_addr ) {
+      errno = ENOMEM;
+      fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+      return (void *)-1;
+    }
+  } while (!__atomic_compare_exchange_n(&r->brk, &old_brk, old_brk + incr, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  if (incr < 0)
+    mem_release(r, old_brk + incr, old_brk);
+
+  /* the part of a heap dropped by mem_reset_brk that is handed out again */
+  char *dirty = __atomic_load_n(&r->dirty, __ATOMIC_RELAXED);
+  if (incr > 0 && old_brk < dirty)
+    memset(old_brk, 0, (old_brk + incr < dirty ? old_brk + incr : dirty) - old_brk);
   return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the memory in [lo, hi) back after the heap shrank.
+ *    Whole pages are dropped with madvise(MADV_DONTNEED), or for a heap
+ *    file punched out of it with MADV_REMOVE, so they stop counting toward
+ *    RSS and read as zero when touched again; partial pages at either end
+ *    are cleared by hand. Either way the memory above the brk stays
+ *    zero-filled.
+ */
+static void mem_release(mem_region_t *r, char *lo, char *hi) {
+  uintptr_t page = mem_pagesize();
+  char *page_lo = (char *)(((uintptr_t)lo + page - 1) & ~(page - 1));
+  char *page_hi = (char *)((uintptr_t)hi & ~(page - 1));
+
+  if (page_lo >= page_hi) {
+    memset(lo, 0, hi - lo);
+    return;
+  }
+
+  memset(lo, 0, page_lo - lo);
+  memset(page_hi, 0, hi - page_hi);
+  if (madvise(page_lo, page_hi - page_lo, r->file ? MADV_REMOVE : MADV_DONTNEED) != 0)
+    memset(page_lo, 0, page_hi - page_lo);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
 void *mem_heap_lo() {
-  return (void *)mem_start_brk;
+  return mem_region_lo(&mem_default);
 }
 
 /* 
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi() {
-  return (void *)(mem_brk - 1);
+  return mem_region_hi(&mem_default);
 }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
 size_t mem_heapsize() {
-  return (size_t)(mem_brk - mem_start_brk);
+  return mem_region_size(&mem_default);
+}
+
+/*
+ * mem_region_lo, mem_region_hi, mem_region_size - the same for the heap
+ *    in region r
+ */
+void *mem_region_lo(mem_region_t *r) {
+  return (void *)r->start_brk;
+}
+
+void *mem_region_hi(mem_region_t *r) {
+  return (void *)(__atomic_load_n(&r->brk, __ATOMIC_ACQUIRE) - 1);
+}
+
+size_t mem_region_size(mem_region_t *r) {
+  return (size_t)(__atomic_load_n(&r->brk, __ATOMIC_ACQUIRE) - r->start_brk);
 }
 
 /*
@@ -0,0 +1,37 @@
+/*
+ * memlib.h - interface to the memory system model in memlib.c
+ */
+#include <unistd.h>
+#include <stdint.h>
+
+/* flags for mem_init_backing */
+#define MEM_MMAP     0x1   /* back the heap with its own mapping */
+#define MEM_HUGEPAGE 0x2   /* ask for transparent huge pages */
+#define MEM_POPULATE 0x4   /* prefault the whole heap up front */
+
+/* bytes of a heap file's metadata kept for the allocator,
+   see mem_region_user_area */
+#define MEM_USER_AREA 1024
+
+/* a simulated heap; mem_init sets up the default one */
+typedef struct mem_region mem_region_t;
+
+void mem_init(void);
+void mem_init_backing(int flags);
+int mem_init_file(const char *path, void *base);
+void mem_deinit(void);
+void *mem_sbrk(intptr_t incr);
+void mem_reset_brk(void);
+void *mem_heap_lo(void);
+void *mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
+
+mem_region_t *mem_default_region(void);
+mem_region_t *mem_region_create(size_t size);
+void mem_region_destroy(mem_region_t *r);
+void *mem_region_sbrk(mem_region_t *r, intptr_t incr);
+void *mem_region_lo(mem_region_t *r);
+void *mem_region_hi(mem_region_t *r);
+size_t mem_region_size(mem_region_t *r);
+void *mem_region_user_area(mem_region_t *r);
@@ -10,22 +10,40 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#ifdef MM_THREADS
+#include <pthread.h>
+#define MM_TLS __thread
+#else
+#define MM_TLS
+#endif
 
 #include "memlib.h"
 #include "mm.h"
 
  /*
  *
- * Each block has header and footer of the form:
+ * Each block has a header, and free blocks also have a footer, of the form:
  *
- *      63                  4  3  2  1  0
- *      -----------------------------------
- *     | s  s  s  s  ... s  s  0  0  0  a/f
- *      -----------------------------------
+ *      63        48 47                  4  3  2  1  0
+ *      ------------------------------------------------
+ *     | o ... o | s  s  s  s  ... s  s  h  m  p  a/f
+ *      ------------------------------------------------
  *
- * where s are the meaningful size bits and a/f is set
- * iff the block is allocated. The list has the following form:
+ * where o name the thread cache holding the block in MM_THREADS builds
+ * (see tcache_refill) and are 0 otherwise, s are the meaningful size
+ * bits, a/f is set iff the block is
+ * allocated, p is set iff the previous block in the heap is allocated,
+ * m is set iff the previous block is a mini block (see below) and h is
+ * set iff the block is a huge block living in its own mmap region.
+ * Allocated blocks have no footer: a footer is only needed to find the
+ * start of a free block from its successor, and p tells the successor
+ * whether there is one to read. The list has the following form:
  *
  *
  *    begin                                   end
@@ -42,9 +60,34 @@
  *
  */
 
+/*
+ * Free blocks are kept on segregated free lists, one list per size class.
+ * The classes below 256 bytes hold exactly one block size each (32, 48,
+ * ..., 256), so a small request is served by the first block of its own
+ * class. Larger classes cover power-of-two ranges (256, 512], (512, 1024],
+ * ... and the last class takes everything bigger. Within a class, blocks
+ * are inserted LIFO and searched first-fit.
+ *
+ * Free blocks of MM_TREE_MIN_SIZE bytes or more are not put on a list but
+ * in a splay tree ordered by (size, address) and built from links in
+ * their payload, so the best fit for a large request is found in
+ * amortized O(log n) instead of by scanning a long list.
+ *
+ * Requests of MM_MMAP_THRESHOLD bytes or more never touch the heap. Each
+ * gets its own mmap region holding one allocated block whose header has
+ * the h bit set, and mm_free hands the region straight back with munmap,
+ * so huge buffers neither grow the heap nor leave holes in it.
+ *
+ * Requests of at most one word get a 16-byte mini block: a header and a
+ * single payload word. A free mini block has no room for a footer or two
+ * pointers, so free mini blocks sit on their own list, linked by a pair
+ * of 32-bit offsets packed into that word, and the block after one finds
+ * its start through the m bit instead of a footer.
+ */
+
 /*  Empty block
  *  ------------------------------------------------*
- *  |HEADER:    block size   |     |     | alloc bit|
+ *  |HEADER:    block size   |     |prev | alloc bit|
  *  |-----------------------------------------------|
  *  | pointer to prev free block in this size list  |
  *  |-----------------------------------------------|
@@ -54,15 +97,35 @@
  *  ------------------------------------------------
  */
 
+/*  Large empty block (in the tree)
+ *  ------------------------------------------------*
+ *  |HEADER:    block size   |     |prev | alloc bit|
+ *  |-----------------------------------------------|
+ *  | pointer to left child (smaller blocks)        |
+ *  |-----------------------------------------------|
+ *  | pointer to right child (larger blocks)        |
+ *  |-----------------------------------------------|
+ *  |FOOTER:    block size   |     |     | alloc bit|
+ *  ------------------------------------------------
+ */
+
+/*  Mini block (free / allocated)
+ *  ------------------------------------------------*
+ *  |HEADER:    16           |mini |prev | alloc bit|
+ *  |-----------------------------------------------|
+ *  | prev : next free mini block offsets / Data    |
+ *  ------------------------------------------------
+ */
+
 /*   Allocated block
  *   ------------------------------------------------*
- *   |HEADER:    block size   |     |     | alloc bit|
+ *   |HEADER:    block size   |     |prev | alloc bit|
  *   |-----------------------------------------------|
  *   |               Data                            |
  *   |-----------------------------------------------|
  *   |               Data                            |
  *   |-----------------------------------------------|
- *   |FOOTER:    block size   |     |     | alloc bit|
+ *   |               Data                            |
  *   -------------------------------------------------
  */
 
@@ -78,28 +141,192 @@ static const size_t dsize = 2 * sizeof(word_t);
 
 /*
   Minimum useable block size (bytes):
-  two words for header & footer, two words for payload
+  a free block needs two words for header & footer and two words for the
+  list links; an allocated block of this size has three words of payload
 */
 static const size_t min_block_size = 4 * sizeof(word_t);
 
+// Size of a mini block: header and one word of payload (bytes)
+static const size_t mini_block_size = 2 * sizeof(word_t);
+
+// Largest heap whose blocks the 32-bit mini list links can reach (bytes)
+static const size_t mini_reach = (size_t) 0xFFFFFFFF * 2 * sizeof(word_t);
+
 /* Initial heap size (bytes), requires (chunksize % 16 == 0)
 */
 static const size_t chunksize = (1 << 12);
 
+/*
+ * Each time the heap runs out of space it grows by twice as much as the
+ * last time, starting at chunksize, but by no more than 1/heap_growth_ratio
+ * of the current heap. A growing program thus makes a logarithmic number
+ * of mem_sbrk calls, and the unused tail stays a small part of the heap.
+ */
+static const size_t heap_growth_ratio = 64;
+
+/*
+ * A free block at the end of the heap bigger than this (bytes) is given
+ * back to memlib when it is freed, leaving chunksize bytes of it.
+ */
+static const size_t trim_threshold = (1 << 18);
+
+/*
+ * Number of segregated free lists. Building with -DMM_NUM_CLASSES=1 and
+ * -DMM_TREE_MIN_SIZE=0 puts every free block on a single list, which is
+ * the old explicit-list allocator and is kept as a baseline for
+ * benchmarking.
+ */
+#ifndef MM_NUM_CLASSES
+#define MM_NUM_CLASSES 19
+#endif
+
+/*
+ * Free blocks at least this big (bytes) go in the size-ordered tree
+ * instead of a list; the default covers the classes above 2 KB. Building
+ * with -DMM_TREE_MIN_SIZE=0 keeps every block on the lists.
+ */
+#ifndef MM_TREE_MIN_SIZE
+#define MM_TREE_MIN_SIZE 4096
+#endif
+
+/*
+ * Requests of at least this many bytes get their own mmap region instead
+ * of heap space. Building with -DMM_MMAP_THRESHOLD=0 serves everything
+ * from the heap.
+ */
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (1 << 17)
+#endif
+
+/*
+ * Placement policy used to pick a block within a size class, chosen at
+ * build time with -DMM_FIT_POLICY=...:
+ *   FIT_FIRST - the first block that fits
+ *   FIT_NEXT  - the first block that fits after where the last search in
+ *               the same class stopped (a roving pointer per class)
+ *   FIT_BEST  - the smallest of the first MM_BEST_FIT_K blocks that fit
+ *               (the default)
+ */
+#define FIT_FIRST 0
+#define FIT_NEXT 1
+#define FIT_BEST 2
+
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY FIT_BEST
+#endif
+
+#ifndef MM_BEST_FIT_K
+#define MM_BEST_FIT_K 8
+#endif
+
+/*
+ * Building with -DMM_DEFER_COALESCE turns on deferred coalescing: freed
+ * blocks of up to quick_max_size bytes go on a quick list for their exact
+ * size and stay marked allocated, so they are neither merged nor listed,
+ * and the next request of that size takes one straight back. All quick
+ * blocks are freed for real, with coalescing, in one sweep when a search
+ * of the free lists fails or they hold more than quick_limit bytes.
+ */
+#ifdef MM_DEFER_COALESCE
+static const size_t quick_max_size = 256;
+static const size_t quick_limit = (1 << 16);
+
+// One list per block size 16, 32, ..., quick_max_size
+#define QUICK_CLASSES (256 / 16)
+#endif
+
+/*
+ * Building with -DMM_PROFILE keeps counters of the requests and frees
+ * made through the mm_* calls, per power-of-two size bucket, plus how
+ * often and by how much the heap grew. Only every MM_PROFILE_RATE-th
+ * malloc and free of each thread is recorded, weighted by the rate, so
+ * the cost on the hot path is one decrement and branch. mm_profile_dump
+ * writes the counters as JSON together with a snapshot of the free
+ * blocks, which it takes in any build.
+ */
+#ifndef MM_PROFILE_RATE
+#define MM_PROFILE_RATE 64
+#endif
+
+// Size buckets [16, 32), [32, 64), ...; the last one takes everything bigger
+#define PROF_BUCKETS 24
+
+/*
+ * Heap checking done on every mm_malloc and mm_free, set with
+ * mm_check_level or at build time with -DMM_CHECK_LEVEL=<n>:
+ *   0 - none (the default)
+ *   1 - the block being allocated or freed and its neighbors, O(1)
+ *   2 - as 1, plus the next check_segment_blocks blocks of the heap in
+ *       rotation, so the whole heap is covered every few thousand calls
+ *   3 - a full check_heap walk
+ * A failed check prints what it found and exits.
+ */
+#ifndef MM_CHECK_LEVEL
+#define MM_CHECK_LEVEL 0
+#endif
+
+// Number of blocks level 2 checks per call
+static const size_t check_segment_blocks = 8;
+
+/*
+ * Building with -DMM_SMALL_PAGES serves requests of up to page_max_size
+ * bytes from small pages instead of blocks. A small page is 4KB of the
+ * heap holding objects of one size only (16, 32, ..., page_max_size),
+ * with no header: the page's metadata sits in a small_page_t at its
+ * start, found by masking the object's address, so a 16-byte request
+ * costs exactly 16 bytes. small_map has one bit per page of the heap
+ * telling whether it is a small page; mm_free looks there first instead
+ * of reading the header in front of the payload. Pages are carved from
+ * runs of page_run_pages pages, each an ordinary allocated block of the
+ * heap, and a page whose objects are all free goes back to a pool to be
+ * reused for any size.
+ */
+#ifdef MM_SMALL_PAGES
+#ifdef MM_THREADS
+#error "MM_SMALL_PAGES does not support MM_THREADS"
+#endif
+
+#define SMALL_PAGE_SIZE (1 << 12)
+
+// One class per object size 16, 32, ..., page_max_size
+#define PAGE_CLASSES (256 / 16)
+
+// Pages small_map can track, starting at the page of mem_heap_lo (4GB)
+#define SMALL_MAP_PAGES (1 << 20)
+
+static const size_t page_max_size = 256;
+static const size_t page_run_pages = 16;
+#endif
+
+// Largest block size that has its own exact-size class (bytes)
+static const size_t small_class_max = 256;
+
+// Number of exact-size classes: 32, 48, ..., small_class_max
+static const size_t num_small_classes = (256 - 32) / 16 + 1;
+
 // Mask to extract allocated bit from header
 static const word_t alloc_mask = 0x1;
 
+// Mask to extract the previous block's allocated bit from header
+static const word_t prev_alloc_mask = 0x2;
+
+// Mask to extract the bit that marks the previous block as a mini block
+static const word_t prev_mini_mask = 0x4;
+
+// Mask to extract the bit that marks a huge block in its own mmap region
+static const word_t mmap_mask = 0x8;
+
 /*
  * Assume: All block sizes are a multiple of 16
- * and so can use lower 4 bits for flags
+ * and so can use lower 4 bits for flags, and are below 2^48
  */
-static const word_t size_mask = ~(word_t) 0xF;
+static const word_t size_mask = (((word_t) 1 << 48) - 1) & ~(word_t) 0xF;
 
 /*
-  All blocks have both headers and footers
+  All blocks have headers; only free blocks have footers
 
   Both the header and the footer consist of a single word containing the
-  size and the allocation flag, where size is the total size of the block,
+  size and the allocation flags, where size is the total size of the block,
   including header, (possibly payload), unused space, and footer
 */
 
@@ -111,6 +338,8 @@ struct block
     /* Header contains:
     *  a. size
     *  b. allocation flag
+    *  c. allocation flag of the previous block
+    *  d. whether the previous block is a mini block
     */
     word_t header;
 
@@ -121,6 +350,16 @@ struct block
             block_t *prev;
             block_t *next;
         } links;
+        /* Large free blocks are tree nodes instead */
+        struct
+        {
+            block_t *left;
+            block_t *right;
+        } tree;
+        /* Free mini blocks pack their list links into one word */
+        word_t mini_links;
+        /* Quick blocks only need a next pointer */
+        block_t *mini_next;
         /*
         * We don't know what the size of the payload will be, so we will
         * declare it as a zero-length array.  This allows us to obtain a
@@ -131,7 +370,10 @@ struct block
     /*
      * Payload contains:
      * a. only data if allocated
-     * b. pointers to next/previous free blocks if unallocated
+     * b. pointers to next/previous free blocks if unallocated, or to
+     *    the left/right children for large free blocks
+     * c. the offsets of the prev/next free mini blocks for free mini
+     *    blocks
      */
     } payload;
 
@@ -143,21 +385,156 @@ struct block
 
 /* Global variables */
 
-// Pointer to first block
-static block_t *heap_start = NULL;
+#ifdef MM_PROFILE
+typedef struct {
+    size_t mallocs[PROF_BUCKETS];       // by block size
+    size_t malloc_bytes[PROF_BUCKETS];  // payload bytes requested
+    size_t frees[PROF_BUCKETS];
+    size_t free_bytes[PROF_BUCKETS];    // block bytes freed
+    size_t extends;                     // times the heap grew
+    size_t extend_bytes;
+} prof_t;
+#endif
+
+#ifdef MM_SMALL_PAGES
+// Metadata at the start of each small page; the objects follow it
+typedef struct small_page {
+    struct small_page *next;    // in its class list or the pool
+    struct small_page *prev;    // in its class list
+    uint16_t free;              // offset of the first freed object, 0 if none;
+                                // each freed object starts with the next one's
+    uint16_t obj_size;
+    uint16_t used;              // objects handed out and not yet freed
+    uint16_t carved;            // objects ever taken from the page
+    uint16_t capacity;
+    uint16_t run_page;          // index of the page in its run
+    uint16_t run_pooled;        // first page of a run only: its pages in the pool
+} small_page_t;
+#endif
+
+/*
+ * Everything kept about one heap outside of the blocks themselves. The
+ * default heap, used by mm_malloc and the other mm_* calls, is static;
+ * mm_heap_create puts the struct of each extra heap at the start of its
+ * own memlib region. The heap routines below all work on the heap that
+ * heap points to.
+ */
+struct mm_heap {
+    // Memory the heap lives in
+    mem_region_t *region;
+
+    // Pointer to first block
+    block_t *heap_start;
+
+    // The epilogue header, moved by extend_heap and heap_trim
+    block_t *epilogue;
+
+    // Heads of the segregated free lists, indexed by size class
+    block_t *seg_list[MM_NUM_CLASSES];
+
+    // Head of the list of free mini blocks
+    block_t *mini_list;
+
+    // Root of the splay tree of large free blocks
+    block_t *tree_root;
+
+    // How much the heap grows by the next time it runs out of space
+    size_t extend_size;
+
+    // Requests of this many bytes or more get their own mmap region (0
+    // for never)
+    size_t mmap_threshold;
+
+    // Where the next level 2 check segment starts (NULL for the start of
+    // the heap)
+    block_t *check_cursor;
 
-// Pointer to the first block in the free list
-static block_t *free_list_head = NULL;
+#if MM_FIT_POLICY == FIT_NEXT
+    // Where the next search of each size class starts
+    block_t *rover[MM_NUM_CLASSES];
+#endif
+
+#ifdef MM_DEFER_COALESCE
+    // Quick lists, linked through the first payload word, and their total size
+    block_t *quick_list[QUICK_CLASSES];
+    size_t quick_bytes;
+#endif
+
+#ifdef MM_PROFILE
+    prof_t prof;
+#endif
+
+#ifdef MM_SMALL_PAGES
+    // Per class, the pages that have an object to spare; full pages are on
+    // no list until one of their objects is freed
+    small_page_t *page_class[PAGE_CLASSES];
+
+    // Unused pages, linked through next
+    small_page_t *page_pool;
+
+    // One bit per heap page, set for small pages; small_map_hi bounds the
+    // words that have ever been written
+    uint64_t small_map[SMALL_MAP_PAGES / 64];
+    size_t small_map_hi;
+    uintptr_t small_base;
+#endif
+};
+
+static mm_heap_t default_heap = { .mmap_threshold = MM_MMAP_THRESHOLD };
+
+// The heap being worked on; the default heap except inside mm_heap_* calls
+static MM_TLS mm_heap_t *heap = &default_heap;
+
+#ifdef MM_PROFILE
+// Requests of this thread left until its next profile sample
+static MM_TLS unsigned prof_malloc_countdown = MM_PROFILE_RATE;
+static MM_TLS unsigned prof_free_countdown = MM_PROFILE_RATE;
+#endif
+
+// Current check level
+static int check_level = MM_CHECK_LEVEL;
+
+// While a batch is being freed, the first payload word of each of its
+// blocks holds this, marking it as free but not yet on a list. It is
+// neither a pointer nor the links of a free mini block, whose prev and
+// next are never the same block.
+#define BATCH_MARK ((block_t *) ~(uintptr_t) 0)
+
+// "mmroot01", marking a checkpoint in memlib's user area
+#define MM_ROOT_MAGIC 0x3130746f6f726d6dULL
+
+// What heap_checkpoint saves of the default heap
+typedef struct {
+    uint64_t magic;
+    uint64_t num_classes;       // MM_NUM_CLASSES of the build that saved it
+    uint64_t tree_min_size;     // and its MM_TREE_MIN_SIZE
+    block_t *heap_start;
+    block_t *seg_list[MM_NUM_CLASSES];
+    block_t *mini_list;
+    block_t *tree_root;
+    size_t extend_size;
+} mm_root_t;
+
+_Static_assert(sizeof(mm_root_t) <= MEM_USER_AREA, "mm_root_t does not fit in MEM_USER_AREA");
 
 /* Function prototypes for internal helper routines */
 
 static size_t max(size_t x, size_t y);
+static size_t min(size_t x, size_t y);
+static size_t adjust_size(size_t size);
 static block_t *find_fit(size_t asize);
+static block_t *search_class(size_t index, size_t asize);
+
+static bool in_tree(size_t size);
+static block_t *tree_splay(block_t *root, size_t size, block_t *addr);
+static void tree_insert(block_t *block);
+static void tree_remove(block_t *block);
+static block_t *tree_find_fit(size_t asize);
 static block_t *coalesce_block(block_t *block);
 static void split_block(block_t *block, size_t asize);
 
 static size_t round_up(size_t size, size_t n);
-static word_t pack(size_t size, bool alloc);
+static word_t pack(size_t size, bool prev_alloc, bool prev_mini, bool alloc);
 
 static size_t extract_size(word_t header);
 static size_t get_size(block_t *block);
@@ -165,7 +542,13 @@ static size_t get_size(block_t *block);
 static bool extract_alloc(word_t header);
 static bool get_alloc(block_t *block);
 
-static void write_header(block_t *block, size_t size, bool alloc);
+static bool extract_prev_alloc(word_t header);
+static bool get_prev_alloc(block_t *block);
+static bool get_prev_mini(block_t *block);
+static void write_next_prev(block_t *block);
+
+static void write_header(block_t *block, size_t size, bool prev_alloc,
+                         bool prev_mini, bool alloc);
 static void write_footer(block_t *block, size_t size, bool alloc);
 
 static block_t *payload_to_header(void *bp);
@@ -176,225 +559,2199 @@ static block_t *find_next(block_t *block);
 static word_t *find_prev_footer(block_t *block);
 static block_t *find_prev(block_t *block);
 
+static int in_heap(const void* p);
 static bool check_heap();
+static bool check_tree(size_t *count);
+static bool check_free_lists(size_t limit, size_t *count);
+static inline bool check_block(block_t *block);
+static bool check_segment(void);
+static inline void check_request(block_t *block);
+static void check_forget(block_t *block, size_t size);
 static void examine_heap();
 
+static mm_heap_t *heap_switch(mm_heap_t *to);
+static int heap_init(void);
+static void heap_clear(void);
+static int heap_checkpoint(void);
+static int heap_attach(void);
+static void *heap_malloc(size_t size);
+static void *heap_realloc(void *ptr, size_t size);
+static void *heap_calloc(size_t nmemb, size_t size);
+static void *heap_memalign(size_t align, size_t size);
+static void heap_free(void *bp);
+static bool heap_trim(size_t pad);
+static size_t heap_malloc_batch(size_t size, void **ptrs, size_t n);
+static size_t batch_carve(block_t *block, size_t asize, void **ptrs, size_t n);
+static void heap_free_batch(void **ptrs, size_t n);
+static block_t *free_block(block_t *block);
+#ifdef MM_DEFER_COALESCE
+static void quick_sweep(void);
+#endif
+
+static bool use_mmap(size_t size);
+static bool get_mmap(block_t *block);
+static void *huge_malloc(size_t size, size_t align);
+static unsigned char *huge_region(block_t *block);
+static void huge_free(block_t *block);
+
+#ifdef MM_SMALL_PAGES
+static bool small_owns(const void *bp);
+static void *small_malloc(size_t size);
+static void small_free(void *bp);
+static small_page_t *small_new_page(size_t obj_size);
+static small_page_t *small_run(small_page_t *page);
+static void small_pool_push(small_page_t *page);
+static void small_release(void);
+#endif
+
+static size_t prof_bucket(size_t size);
+static void prof_malloc(size_t size, size_t n);
+static void prof_free(void *bp);
+static int heap_profile_dump(FILE *fp);
+
 static block_t *extend_heap(size_t size);
+static size_t find_class(size_t size);
 static void insert_block(block_t *free_block);
 static void remove_block(block_t *free_block);
+static word_t mini_ref(block_t *block);
+static block_t *mini_deref(word_t ref);
+static block_t *mini_get_next(block_t *block);
+static block_t *mini_get_prev(block_t *block);
+static void mini_set_links(block_t *block, block_t *prev, block_t *next);
 
 /*
- * mm_init - Initialize the memory manager
+ * heap_init - Initialize the shared heap
  */
-int mm_init(void)
+static int heap_init(void)
 {
     /* Create the initial empty heap */
-    word_t *start = (word_t *)(mem_sbrk(2*wsize));
+    word_t *start = (word_t *)(mem_region_sbrk(heap->region, 2*wsize));
     if ((ssize_t)start == -1) {
         printf("ERROR: mem_sbrk failed in mm_init, returning %p\n", start);
         return -1;
     }
 
     /* Prologue footer */
-    start[0] = pack(0, true);
+    start[0] = pack(0, true, false, true);
     /* Epilogue header */
-    start[1] = pack(0, true);
+    start[1] = pack(0, true, false, true);
 
     /* Heap starts with first "block header", currently the epilogue header */
-    heap_start = (block_t *) &(start[1]);
+    heap->heap_start = (block_t *) &(start[1]);
+    heap->epilogue = heap->heap_start;
+    heap_clear();
 
     /* Extend the empty heap with a free block of chunksize bytes */
-    block_t *free_block = extend_heap(chunksize);
-    if (free_block == NULL) {
+    if (extend_heap(chunksize) == NULL) {
         printf("ERROR: extend_heap failed in mm_init, returning");
         return -1;
     }
 
-    /* Set the head of the free list to this new free block */
-    free_list_head = free_block;
-    free_list_head->payload.links.prev = NULL;
-    free_list_head->payload.links.next = NULL;
+    return 0;
+}
+
+/*
+ * heap_switch - Make `to` the heap that the heap routines work on. Returns
+ * the heap they worked on before.
+ */
+static mm_heap_t *heap_switch(mm_heap_t *to)
+{
+    mm_heap_t *from = heap;
+    heap = to;
+    return from;
+}
+
+/*
+ * heap_clear - Reset everything kept about the heap outside of it, as
+ * for a heap with no free blocks
+ */
+static void heap_clear(void)
+{
+    /* All size classes start out empty */
+    for (size_t i = 0; i < MM_NUM_CLASSES; i++)
+        heap->seg_list[i] = NULL;
+    heap->mini_list = NULL;
+    heap->tree_root = NULL;
+    heap->extend_size = chunksize;
+    heap->check_cursor = NULL;
+#if MM_FIT_POLICY == FIT_NEXT
+    for (size_t i = 0; i < MM_NUM_CLASSES; i++)
+        heap->rover[i] = NULL;
+#endif
+#ifdef MM_DEFER_COALESCE
+    for (size_t i = 0; i < QUICK_CLASSES; i++)
+        heap->quick_list[i] = NULL;
+    heap->quick_bytes = 0;
+#endif
+#ifdef MM_PROFILE
+    memset(&heap->prof, 0, sizeof(heap->prof));
+#endif
+#ifdef MM_SMALL_PAGES
+    for (size_t i = 0; i < PAGE_CLASSES; i++)
+        heap->page_class[i] = NULL;
+    heap->page_pool = NULL;
+    memset(heap->small_map, 0, heap->small_map_hi * sizeof(heap->small_map[0]));
+    heap->small_map_hi = 0;
+    heap->small_base = (uintptr_t) mem_region_lo(heap->region) & ~(uintptr_t) (SMALL_PAGE_SIZE - 1);
+#endif
+}
+
+/*
+ * heap_checkpoint - Save where the free blocks are into memlib's user
+ * area, so that heap_attach can resume the heap once memlib has reopened
+ * its file. Quick blocks are freed for real first. Small pages are not
+ * supported, since small_map lives outside the heap. Returns 0 on
+ * success and -1 if the heap is not file-backed.
+ */
+static int heap_checkpoint(void)
+{
+    mm_root_t *root = mem_region_user_area(heap->region);
+
+#ifdef MM_SMALL_PAGES
+    root = NULL;
+#endif
+    if (root == NULL)
+        return -1;
+
+#ifdef MM_DEFER_COALESCE
+    quick_sweep();
+#endif
+
+    root->magic = MM_ROOT_MAGIC;
+    root->num_classes = MM_NUM_CLASSES;
+    root->tree_min_size = MM_TREE_MIN_SIZE;
+    root->heap_start = heap->heap_start;
+    for (size_t i = 0; i < MM_NUM_CLASSES; i++)
+        root->seg_list[i] = heap->seg_list[i];
+    root->mini_list = heap->mini_list;
+    root->tree_root = heap->tree_root;
+    root->extend_size = heap->extend_size;
 
     return 0;
 }
 
 /*
- * mm_malloc - Allocate a block with at least size bytes of payload
+ * heap_attach - Resume the heap that memlib reopened from its file, from
+ * the roots heap_checkpoint saved. The prologue and epilogue are checked,
+ * and every free list and the tree are walked, which reads in the free
+ * blocks but none of the allocated ones. The roots are used up: a heap
+ * that is changed after attaching needs a new checkpoint. Returns 0 on
+ * success and -1 if there is no checkpoint for a heap of this build, or
+ * the heap does not check out.
  */
-void *mm_malloc(size_t size)
+static int heap_attach(void)
+{
+    mm_root_t *root = mem_region_user_area(heap->region);
+    word_t *start = mem_region_lo(heap->region);
+    block_t *epilogue = (block_t *) ((unsigned char *) mem_region_hi(heap->region) + 1 - wsize);
+
+#ifdef MM_SMALL_PAGES
+    root = NULL;
+#endif
+    if (root == NULL || root->magic != MM_ROOT_MAGIC
+        || root->num_classes != MM_NUM_CLASSES || root->tree_min_size != MM_TREE_MIN_SIZE)
+        return -1;
+
+    if (mem_region_size(heap->region) < 2 * wsize || start[0] != pack(0, true, false, true)
+        || root->heap_start != (block_t *) &start[1]) {
+        printf("ERROR: bad prologue in mm_attach\n");
+        return -1;
+    }
+    if (get_size(epilogue) != 0 || !get_alloc(epilogue)) {
+        printf("ERROR: bad epilogue in mm_attach\n");
+        return -1;
+    }
+
+    heap->heap_start = root->heap_start;
+    heap->epilogue = epilogue;
+    heap_clear();
+    for (size_t i = 0; i < MM_NUM_CLASSES; i++)
+        heap->seg_list[i] = root->seg_list[i];
+    heap->mini_list = root->mini_list;
+    heap->tree_root = root->tree_root;
+    heap->extend_size = root->extend_size;
+    root->magic = 0;
+
+    size_t count = 0;
+    if (!check_free_lists(mem_region_size(heap->region) / mini_block_size, &count) || !check_tree(&count)) {
+        printf("ERROR: bad free lists in mm_attach\n");
+        heap_clear();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * heap_malloc - Allocate a block with at least size bytes of payload
+ */
+static void *heap_malloc(size_t size)
 {
     size_t asize;      // Allocated block size
     block_t* block;
-    void* bp = NULL;;
+    void* bp = NULL;
 
     if (size == 0) // Ignore spurious request
         return bp;
 
-    // Too small block
-    if (size <= dsize) {
-        asize = min_block_size;
-    } else {
-        // Round up and adjust to meet alignment requirements
-        asize = round_up(size + dsize, dsize);
+    asize = adjust_size(size);
+
+    if (use_mmap(size))
+        return huge_malloc(size, dsize);
+
+#ifdef MM_SMALL_PAGES
+    if (size <= page_max_size && (bp = small_malloc(size)) != NULL)
+        return bp;
+#endif
+
+#ifdef MM_DEFER_COALESCE
+    if (asize <= quick_max_size && heap->quick_list[asize / dsize - 1] != NULL) {
+        block = heap->quick_list[asize / dsize - 1];
+        heap->quick_list[asize / dsize - 1] = block->payload.mini_next;
+        heap->quick_bytes -= asize;
+        if (check_level > 0)
+            check_request(block);
+        return header_to_payload(block);
     }
+#endif
 
-  // TODO: Implement mm_malloc.  You can change or remove any of the above
-  // code.  It is included as a suggestion of where to start.
-  // You will want to replace this return statement...
     block = find_fit(asize);
 
-    if (block == NULL) { // if there is no fit extend the heap and allocate memory from it
-      block = extend_heap(chunksize);
+#ifdef MM_DEFER_COALESCE
+    // Merging the quick blocks may make room without growing the heap
+    if (block == NULL && heap->quick_bytes > 0) {
+        quick_sweep();
+        block = find_fit(asize);
     }
+#endif
 
-    size_t block_size = sizeof(block);
-    write_header(block, block_size, true);
-    write_footer(block, block_size, true);
+    if (block == NULL) { // if there is no fit extend the heap and allocate memory from it
+        block = extend_heap(max(asize, heap->extend_size));
+        if (block == NULL)
+            return bp;
+        heap->extend_size = min(2 * heap->extend_size,
+                          max(chunksize, mem_region_size(heap->region) / heap_growth_ratio));
+    }
 
     remove_block(block); // remove the block from the free list
+    write_header(block, get_size(block), get_prev_alloc(block),
+                 get_prev_mini(block), true);
+    write_next_prev(block);
     split_block(block, asize); // split the block if the space we found was too big
 
-    bp = header_to_payload(block);
+    if (check_level > 0)
+        check_request(block);
+
+    bp = header_to_payload(block);
+
+    return bp;
+}
+
+
+/*
+ * heap_realloc - Resize the block at ptr to hold at least size bytes. The
+ * block is shrunk in place, or grown in place by absorbing a free next
+ * block and, when it is the last block, by extending the heap. Only when
+ * neither works is the payload copied to a new block.
+ */
+static void *heap_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return heap_malloc(size);
+
+    if (size == 0) {
+        heap_free(ptr);
+        return NULL;
+    }
+
+#ifdef MM_SMALL_PAGES
+    if (small_owns(ptr)) {
+        size_t obj_size = ((small_page_t *) ((uintptr_t) ptr & ~(uintptr_t) (SMALL_PAGE_SIZE - 1)))->obj_size;
+        if (size <= obj_size)
+            return ptr;
+
+        void *bp = heap_malloc(size);
+        if (bp == NULL)
+            return NULL;
+        memcpy(bp, ptr, obj_size);
+        small_free(ptr);
+        return bp;
+    }
+#endif
+
+    block_t *block = payload_to_header(ptr);
+    size_t asize = adjust_size(size);
+    size_t block_size = get_size(block);
+
+    // A huge block stays put while the new size still fits and is still huge
+    if (get_mmap(block)) {
+        size_t capacity = huge_region(block) + block_size - (unsigned char *) ptr;
+        if (size <= capacity && use_mmap(size))
+            return ptr;
+
+        void *bp = heap_malloc(size);
+        if (bp == NULL)
+            return NULL;
+        memcpy(bp, ptr, min(size, capacity));
+        huge_free(block);
+        return bp;
+    }
+
+    // Shrink in place, giving the tail back to the free lists
+    if (asize <= block_size) {
+        split_block(block, asize);
+        return ptr;
+    }
+
+    block_t *block_next = find_next(block);
+    size_t next_size = get_alloc(block_next) ? 0 : get_size(block_next);
+
+    // The block is at the end of the heap, possibly followed by one free
+    // block: extend the heap so that the two together are big enough.
+    // A block growing to huge size moves to an mmap region instead.
+    if (block_size + next_size < asize && !use_mmap(size)
+        && get_size(find_next(next_size ? block_next : block)) == 0) {
+        if (extend_heap(asize - block_size - next_size) == NULL)
+            return NULL;
+        block_next = find_next(block);
+        next_size = get_size(block_next);
+    }
+
+    // Grow in place into the free next block
+    if (block_size + next_size >= asize) {
+        remove_block(block_next);
+        write_header(block, block_size + next_size, get_prev_alloc(block),
+                     get_prev_mini(block), true);
+        write_next_prev(block);
+        check_forget(block, block_size + next_size);
+        split_block(block, asize);
+        return ptr;
+    }
+
+    // Last resort: move the payload to a new block
+    void *bp = heap_malloc(size);
+    if (bp == NULL)
+        return NULL;
+
+    memcpy(bp, ptr, min(size, block_size - wsize));
+    heap_free(ptr);
+
+    return bp;
+}
+
+/*
+ * heap_calloc - Allocate zeroed memory for an array of nmemb elements of
+ * size bytes each. memlib hands out pages that have never been written,
+ * so when the heap grows to satisfy the request, only the part of the
+ * payload that was already heap and the words mm.c wrote into the new
+ * memory need to be cleared.
+ */
+static void *heap_calloc(size_t nmemb, size_t size)
+{
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+        return NULL;
+
+    size_t bytes = nmemb * size;
+    unsigned char *old_brk = (unsigned char *) mem_region_hi(heap->region) + 1;
+
+    // Fresh mmap regions are already zero-filled
+    if (use_mmap(bytes))
+        return huge_malloc(bytes, dsize);
+
+    unsigned char *bp = heap_malloc(bytes);
+    if (bp == NULL)
+        return NULL;
+
+#ifdef MM_SMALL_PAGES
+    // Pages are reused from the pool, and have no header to go by
+    if (small_owns(bp)) {
+        memset(bp, 0, bytes);
+        return bp;
+    }
+#endif
+
+    // Served from memory that was heap before this call
+    if (bp + bytes <= old_brk) {
+        memset(bp, 0, bytes);
+        return bp;
+    }
+
+    // Everything below the old break may hold old data; above it, only the
+    // free-list links written at the start of the payload
+    size_t dirty = 2 * wsize;
+    if (old_brk > bp)
+        dirty = max(dirty, (size_t) (old_brk - bp));
+    memset(bp, 0, min(dirty, bytes));
+
+    // The free block footer written at the end of the new memory lands in
+    // the last word of the block when it was not split
+    block_t *block = payload_to_header(bp);
+    unsigned char *footer = (unsigned char *) header_to_footer(block);
+    if (footer >= bp && footer < bp + bytes)
+        memset(footer, 0, min(wsize, (size_t) (bp + bytes - footer)));
+
+    return bp;
+}
+
+/*
+ * heap_memalign - Allocate a block with at least size bytes of payload
+ * aligned to align bytes, a power of two. A block with align bytes to
+ * spare is allocated; the slack in front of the aligned payload becomes
+ * a free block of its own and the tail is split off as usual, so only
+ * the block itself stays allocated.
+ */
+static void *heap_memalign(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (align <= dsize)
+        return heap_malloc(size);
+
+    if (size == 0 || size > SIZE_MAX - align)
+        return NULL;
+
+    if (use_mmap(size + align))
+        return huge_malloc(size, align);
+
+    size_t request = size + align;
+#ifdef MM_SMALL_PAGES
+    // The slack has to be split off a block, so it must not be a small object
+    request = max(request, page_max_size + 1);
+#endif
+
+    unsigned char *bp = heap_malloc(request);
+    if (bp == NULL)
+        return NULL;
+
+    block_t *block = payload_to_header(bp);
+    unsigned char *abp = (unsigned char *) round_up((uintptr_t) bp, align);
+
+    // The gap is a multiple of dsize, so it is always big enough to be
+    // at least a free mini block
+    if (abp != bp) {
+        size_t gap = abp - bp;
+        block_t *aligned = payload_to_header(abp);
+
+        write_header(aligned, get_size(block) - gap, false, gap == mini_block_size, true);
+        write_next_prev(aligned);
+        write_header(block, gap, get_prev_alloc(block), get_prev_mini(block), true);
+        free_block(block);
+        block = aligned;
+    }
+
+    split_block(block, adjust_size(size));
+
+    return abp;
+}
+
+/*
+ * heap_free - Free a block
+ */
+static void heap_free(void *bp)
+{
+    if (bp == NULL)
+        return;
+
+#ifdef MM_SMALL_PAGES
+    if (small_owns(bp)) {
+        small_free(bp);
+        return;
+    }
+#endif
+
+    block_t *block = payload_to_header(bp);
+
+    // The block should be marked as allocated
+    if (!get_alloc(block)) {
+        fprintf(stderr, "ERROR.  Attempted to free unallocated block\n");
+        exit(1);
+    }
+
+    if (get_mmap(block)) {
+        huge_free(block);
+        return;
+    }
+
+    if (check_level > 0)
+        check_request(block);
+
+#ifdef MM_DEFER_COALESCE
+    size_t size = get_size(block);
+    if (size <= quick_max_size) {
+        // heap_malloc hands a quick block out as it is, so its header must
+        // not keep the owner id of the thread cache it came from
+        write_header(block, size, get_prev_alloc(block), get_prev_mini(block), true);
+        block->payload.mini_next = heap->quick_list[size / dsize - 1];
+        heap->quick_list[size / dsize - 1] = block;
+        heap->quick_bytes += size;
+        if (heap->quick_bytes > quick_limit)
+            quick_sweep();
+        return;
+    }
+#endif
+
+    block = free_block(block);
+
+    // Give a large free block at the end of the heap back to memlib
+#ifdef MM_DEFER_COALESCE
+    // Quick blocks may be all that separate it from the end; heap_trim
+    // sweeps them first and then checks
+    if (get_size(block) > trim_threshold)
+        heap_trim(chunksize);
+#else
+    if (get_size(block) > trim_threshold && get_size(find_next(block)) == 0)
+        heap_trim(chunksize);
+#endif
+}
+
+/*
+ * free_block - Mark an allocated block free, merge it with its free
+ * neighbors and put the result on its free list. Returns the merged block.
+ */
+static block_t *free_block(block_t *block)
+{
+    size_t size = get_size(block);
+
+    write_header(block, size, get_prev_alloc(block), get_prev_mini(block), false);
+    write_footer(block, size, false);
+    write_next_prev(block);
+
+    block = coalesce_block(block);
+    insert_block(block);
+
+    return block;
+}
+
+#ifdef MM_DEFER_COALESCE
+/*
+ * quick_sweep - Free every block on the quick lists for real. Each block
+ * merges with whatever neighbors are free by then, including quick blocks
+ * freed earlier in the sweep, so the heap ends up fully coalesced.
+ */
+static void quick_sweep(void)
+{
+    for (size_t i = 0; i < QUICK_CLASSES; i++) {
+        while (heap->quick_list[i] != NULL) {
+            block_t *block = heap->quick_list[i];
+            heap->quick_list[i] = block->payload.mini_next;
+            free_block(block);
+        }
+    }
+    heap->quick_bytes = 0;
+}
+#endif
+
+/*
+ * heap_trim - Shrink the free block at the end of the heap, if there is
+ * one, to pad bytes and release the rest through mem_sbrk. Returns true
+ * if any memory was released.
+ */
+static bool heap_trim(size_t pad)
+{
+#ifdef MM_DEFER_COALESCE
+    // A quick block may be all that stands between the tail and the end
+    quick_sweep();
+#endif
+#ifdef MM_SMALL_PAGES
+    // So may a run of small pages that are no longer used
+    small_release();
+#endif
+
+    block_t *epilogue = heap->epilogue;
+
+    if (get_prev_alloc(epilogue))
+        return false;
+
+    block_t *block = find_prev(epilogue);
+    size_t size = get_size(block);
+    size_t keep = (pad == 0) ? 0 : max(round_up(pad, dsize), mini_block_size);
+    bool prev_mini = get_prev_mini(block);
+
+    if (size <= keep)
+        return false;
+
+    remove_block(block);
+
+    // The epilogue moves to the end of what is kept
+    epilogue = (block_t *) ((unsigned char *) block + keep);
+    if (keep == 0) {
+        write_header(epilogue, 0, true, prev_mini, true);
+    } else {
+        write_header(block, keep, true, prev_mini, false);
+        write_footer(block, keep, false);
+        write_header(epilogue, 0, false, keep == mini_block_size, true);
+        insert_block(block);
+    }
+
+    mem_region_sbrk(heap->region, -(intptr_t) (size - keep));
+    heap->epilogue = epilogue;
+
+    if (heap->check_cursor > epilogue)
+        heap->check_cursor = NULL;
+
+    // Growth starts small again after the heap has shrunk
+    heap->extend_size = chunksize;
+
+    return true;
+}
+
+/*
+ * heap_malloc_batch - Allocate n blocks of at least size bytes each and
+ * store their payloads in ptrs. One search finds a free block big enough
+ * for all of them, and the blocks are carved from it back to back. When
+ * there is no such block, as many as fit are carved from a free block
+ * that holds at least one, so holes are still used, and the heap is
+ * extended once for the rest. Returns the number of blocks allocated,
+ * which is less than n only when the heap is full.
+ */
+static size_t heap_malloc_batch(size_t size, void **ptrs, size_t n)
+{
+    size_t done = 0;
+
+    if (size == 0 || n == 0)
+        return 0;
+
+    if (use_mmap(size)) {
+        while (done < n && (ptrs[done] = huge_malloc(size, dsize)) != NULL)
+            done++;
+        return done;
+    }
+
+#ifdef MM_SMALL_PAGES
+    // Small objects come from pages, which hand them out one at a time
+    if (size <= page_max_size) {
+        while (done < n && (ptrs[done] = heap_malloc(size)) != NULL)
+            done++;
+        return done;
+    }
+#endif
+
+    size_t asize = adjust_size(size);
+
+    // No heap could hold more
+    n = min(n, SIZE_MAX / asize);
+
+    block_t *block = find_fit(n * asize);
+
+#ifdef MM_DEFER_COALESCE
+    if (block == NULL && heap->quick_bytes > 0) {
+        quick_sweep();
+        block = find_fit(n * asize);
+    }
+#endif
+
+    if (block != NULL)
+        return batch_carve(block, asize, ptrs, n);
+
+    // Use up a hole first, then grow the heap by what is still missing
+    if ((block = find_fit(asize)) != NULL)
+        done = batch_carve(block, asize, ptrs, n);
+
+    if (done < n) {
+        block = extend_heap(max((n - done) * asize, heap->extend_size));
+        if (block == NULL)
+            return done;
+        heap->extend_size = min(2 * heap->extend_size,
+                          max(chunksize, mem_region_size(heap->region) / heap_growth_ratio));
+        done += batch_carve(block, asize, ptrs + done, n - done);
+    }
+
+    return done;
+}
+
+/*
+ * batch_carve - Take the free block off its list and carve as many
+ * blocks of asize bytes from it as fit, up to n, storing their payloads
+ * in ptrs. The last block gives back what is left over. Returns the
+ * number of blocks carved.
+ */
+static size_t batch_carve(block_t *block, size_t asize, void **ptrs, size_t n)
+{
+    size_t rest = get_size(block);
+    size_t count = min(n, rest / asize);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+
+    remove_block(block);
+
+    // All but the last block get exactly asize bytes
+    for (size_t i = 0; i + 1 < count; i++) {
+        write_header(block, asize, prev_alloc, prev_mini, true);
+        ptrs[i] = header_to_payload(block);
+        block = find_next(block);
+        rest -= asize;
+        prev_alloc = true;
+        prev_mini = (asize == mini_block_size);
+    }
+
+    // The last one takes what is left and gives back what it can
+    write_header(block, rest, prev_alloc, prev_mini, true);
+    write_next_prev(block);
+    split_block(block, asize);
+    ptrs[count - 1] = header_to_payload(block);
+
+    return count;
+}
+
+/*
+ * heap_free_batch - Free the n blocks in ptrs (NULL entries are skipped).
+ * The blocks are first all marked free with BATCH_MARK in their payload.
+ * Then each run of adjacent marked blocks is merged in one step,
+ * coalesced with its free neighbors on the lists and inserted, so a run
+ * of k blocks costs one list insertion instead of k.
+ */
+static void heap_free_batch(void **ptrs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL)
+            continue;
+
+#ifdef MM_SMALL_PAGES
+        // Small objects go back right away too
+        if (small_owns(ptrs[i])) {
+            small_free(ptrs[i]);
+            continue;
+        }
+#endif
+
+        block_t *block = payload_to_header(ptrs[i]);
+        size_t size = get_size(block);
+
+        if (!get_alloc(block)) {
+            fprintf(stderr, "ERROR.  Attempted to free unallocated block\n");
+            exit(1);
+        }
+
+        // Huge blocks go back right away; the second pass skips them
+        if (get_mmap(block)) {
+            huge_free(block);
+            continue;
+        }
+
+        write_header(block, size, get_prev_alloc(block), get_prev_mini(block), false);
+        write_footer(block, size, false);
+        write_next_prev(block);
+        block->payload.mini_next = BATCH_MARK;
+    }
+
+    bool trim = false;
+
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL)
+            continue;
+
+#ifdef MM_SMALL_PAGES
+        if (small_owns(ptrs[i]))
+            continue;
+#endif
+
+        block_t *block = payload_to_header(ptrs[i]);
+
+        // A huge block, already unmapped. The header of a block merged
+        // into an earlier run may have been overwritten by the free list
+        // links of the merged block, so it must not be read here.
+        if (!in_heap(block))
+            continue;
+
+        // Already merged into an earlier run
+        if (block->payload.mini_next != BATCH_MARK)
+            continue;
+
+        // Back up to the first marked block of the run
+        while (!get_prev_alloc(block) && find_prev(block)->payload.mini_next == BATCH_MARK)
+            block = find_prev(block);
+
+        // Merge the run, unmarking its blocks
+        size_t size = 0;
+        block_t *curr = block;
+        do {
+            curr->payload.mini_next = NULL;
+            size += get_size(curr);
+            curr = find_next(curr);
+        } while (!get_alloc(curr) && curr->payload.mini_next == BATCH_MARK);
+
+        write_header(block, size, get_prev_alloc(block), get_prev_mini(block), false);
+        write_footer(block, size, false);
+        write_next_prev(block);
+        check_forget(block, size);
+
+        block = coalesce_block(block);
+        insert_block(block);
+
+        if (get_size(block) > trim_threshold && get_size(find_next(block)) == 0)
+            trim = true;
+    }
+
+    // Give a large free block at the end of the heap back to memlib
+    if (trim)
+        heap_trim(chunksize);
+}
+
+/*
+ * use_mmap - Return whether a request of size bytes gets its own mmap region
+ */
+static bool use_mmap(size_t size)
+{
+    return heap->mmap_threshold != 0 && size >= heap->mmap_threshold;
+}
+
+/*
+ * huge_malloc - Map a region just for one huge block and return its
+ * payload, aligned to align bytes (a power of two, at least dsize). The
+ * header sits right before the payload, and the word before the header
+ * holds the header's offset from the start of the region; the block size
+ * is the length of the whole region. For align above dsize the region is
+ * mapped with room to slide the payload into place, and the whole pages
+ * left over at either end are unmapped again.
+ */
+static void *huge_malloc(size_t size, size_t align)
+{
+    size_t page = mem_pagesize();
+    size_t slide = (align > dsize) ? round_up(align, page) : 0;
+
+    if (size > SIZE_MAX - dsize - page - slide)
+        return NULL;
+
+    size_t length = round_up(size + dsize, page) + slide;
+    unsigned char *region = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        return NULL;
+
+    unsigned char *bp = (unsigned char *) round_up((uintptr_t) region + dsize, align);
+    unsigned char *start = (unsigned char *) ((uintptr_t) (bp - dsize) & ~(page - 1));
+    unsigned char *end = (unsigned char *) round_up((uintptr_t) bp + size, page);
+
+    if (start > region)
+        munmap(region, start - region);
+    if (end < region + length)
+        munmap(end, region + length - end);
+
+    block_t *block = payload_to_header(bp);
+    *((word_t *) block - 1) = (unsigned char *) block - start;
+    block->header = pack(end - start, true, false, true) | mmap_mask;
+
+    return bp;
+}
+
+/*
+ * huge_region - Return the start of the region holding a huge block
+ */
+static unsigned char *huge_region(block_t *block)
+{
+    return (unsigned char *) block - *((word_t *) block - 1);
+}
+
+/*
+ * huge_free - Unmap the region holding a huge block
+ */
+static void huge_free(block_t *block)
+{
+    munmap(huge_region(block), get_size(block));
+}
+
+#ifdef MM_SMALL_PAGES
+/*
+ * small_owns - Return whether bp lies in a small page
+ */
+static bool small_owns(const void *bp)
+{
+    uintptr_t page = ((uintptr_t) bp - heap->small_base) / SMALL_PAGE_SIZE;
+
+    if ((uintptr_t) bp < heap->small_base || page >= SMALL_MAP_PAGES)
+        return false;
+    return (heap->small_map[page / 64] >> (page % 64)) & 1;
+}
+
+/*
+ * small_malloc - Take an object of at least size bytes from a page of its
+ * class, starting a page for the class if it has none with room. Returns
+ * NULL if no page could be had, and the request is served by a block.
+ */
+static void *small_malloc(size_t size)
+{
+    size_t index = (size - 1) / dsize;
+    small_page_t *page = heap->page_class[index];
+
+    if (page == NULL) {
+        page = small_new_page((index + 1) * dsize);
+        if (page == NULL)
+            return NULL;
+        heap->page_class[index] = page;
+    }
+
+    // Reuse a freed object, else carve the next one that was never used
+    unsigned char *bp;
+    if (page->free != 0) {
+        bp = (unsigned char *) page + page->free;
+        page->free = *(uint16_t *) bp;
+    } else {
+        bp = (unsigned char *) page + sizeof(small_page_t) + (size_t) page->carved++ * page->obj_size;
+    }
+
+    // A full page leaves its class list
+    if (++page->used == page->capacity) {
+        heap->page_class[index] = page->next;
+        if (page->next != NULL)
+            page->next->prev = NULL;
+    }
+
+    return bp;
+}
+
+/*
+ * small_free - Give an object back to its page. A page that was full
+ * rejoins its class list, and a page that is now empty goes to the pool,
+ * unless it is the only page its class has left.
+ */
+static void small_free(void *bp)
+{
+    small_page_t *page = (small_page_t *) ((uintptr_t) bp & ~(uintptr_t) (SMALL_PAGE_SIZE - 1));
+    size_t index = page->obj_size / dsize - 1;
+
+    if (page->used == 0) {
+        fprintf(stderr, "ERROR.  Attempted to free unallocated block\n");
+        exit(1);
+    }
+
+    *(uint16_t *) bp = page->free;
+    page->free = (unsigned char *) bp - (unsigned char *) page;
+
+    if (page->used-- == page->capacity) {
+        page->prev = NULL;
+        page->next = heap->page_class[index];
+        if (page->next != NULL)
+            page->next->prev = page;
+        heap->page_class[index] = page;
+    }
+
+    if (page->used == 0 && (page->prev != NULL || page->next != NULL)) {
+        if (page->prev != NULL)
+            page->prev->next = page->next;
+        else
+            heap->page_class[index] = page->next;
+        if (page->next != NULL)
+            page->next->prev = page->prev;
+
+        small_pool_push(page);
+    }
+}
+
+/*
+ * small_new_page - Set up a page for objects of obj_size bytes, taking it
+ * from the pool or, when that is empty, from a new run of pages allocated
+ * as one block. Returns NULL if the heap is full or the run lies outside
+ * what small_map covers.
+ */
+static small_page_t *small_new_page(size_t obj_size)
+{
+    if (heap->page_pool == NULL) {
+        unsigned char *run = heap_memalign(SMALL_PAGE_SIZE, page_run_pages * SMALL_PAGE_SIZE);
+        if (run == NULL)
+            return NULL;
+
+        uintptr_t first = ((uintptr_t) run - heap->small_base) / SMALL_PAGE_SIZE;
+        if ((uintptr_t) run < heap->small_base || first + page_run_pages > SMALL_MAP_PAGES) {
+            heap_free(run);
+            return NULL;
+        }
+
+        ((small_page_t *) run)->run_pooled = 0;
+        for (size_t i = 0; i < page_run_pages; i++) {
+            small_page_t *page = (small_page_t *) (run + i * SMALL_PAGE_SIZE);
+            page->run_page = i;
+            small_pool_push(page);
+            heap->small_map[(first + i) / 64] |= (uint64_t) 1 << ((first + i) % 64);
+        }
+        heap->small_map_hi = max(heap->small_map_hi, (first + page_run_pages + 63) / 64);
+    }
+
+    small_page_t *page = heap->page_pool;
+    heap->page_pool = page->next;
+    small_run(page)->run_pooled--;
+
+    page->next = NULL;
+    page->prev = NULL;
+    page->free = 0;
+    page->obj_size = obj_size;
+    page->used = 0;
+    page->carved = 0;
+    page->capacity = (SMALL_PAGE_SIZE - sizeof(small_page_t)) / obj_size;
+
+    return page;
+}
+
+/*
+ * small_run - Return the first page of the run holding page
+ */
+static small_page_t *small_run(small_page_t *page)
+{
+    return (small_page_t *) ((unsigned char *) page - (size_t) page->run_page * SMALL_PAGE_SIZE);
+}
+
+/*
+ * small_pool_push - Put an unused page in the pool
+ */
+static void small_pool_push(small_page_t *page)
+{
+    page->next = heap->page_pool;
+    heap->page_pool = page;
+    small_run(page)->run_pooled++;
+}
+
+/*
+ * small_release - Free every run whose pages are all unused. The empty
+ * page each class keeps goes to the pool first, and the pool is rebuilt
+ * without the runs, since freeing a run writes free list links over the
+ * metadata of its first page.
+ */
+static void small_release(void)
+{
+    small_page_t *keep = NULL;
+    small_page_t *runs = NULL;
+
+    for (size_t i = 0; i < PAGE_CLASSES; i++) {
+        small_page_t **link = &heap->page_class[i];
+        while (*link != NULL) {
+            small_page_t *page = *link;
+            if (page->used != 0) {
+                link = &page->next;
+                continue;
+            }
+            *link = page->next;
+            if (page->next != NULL)
+                page->next->prev = page->prev;
+            small_pool_push(page);
+        }
+    }
+
+    while (heap->page_pool != NULL) {
+        small_page_t *page = heap->page_pool;
+        heap->page_pool = page->next;
+
+        if (small_run(page)->run_pooled < page_run_pages) {
+            page->next = keep;
+            keep = page;
+        } else if (page->run_page == 0) {
+            page->next = runs;
+            runs = page;
+        }
+    }
+    heap->page_pool = keep;
+
+    while (runs != NULL) {
+        unsigned char *run = (unsigned char *) runs;
+        uintptr_t first = ((uintptr_t) run - heap->small_base) / SMALL_PAGE_SIZE;
+        runs = runs->next;
+
+        for (size_t i = first; i < first + page_run_pages; i++)
+            heap->small_map[i / 64] &= ~((uint64_t) 1 << (i % 64));
+        free_block(payload_to_header(run));
+    }
+}
+#endif
+
+/*
+ *****************************************************************************
+ * Public interface. In a normal build these go straight to the heap        *
+ * routines above. Building with -DMM_THREADS makes the allocator safe to   *
+ * use from several threads: the heap is guarded by heap_lock, and each     *
+ * thread keeps a small cache of free blocks per small size class that it   *
+ * fills and drains in batches, so most calls never take the lock. Blocks   *
+ * freed by a thread other than the one that allocated them are handed back *
+ * through a lock-free remote free list.                                    *
+ *****************************************************************************
+ */
+
+#ifdef MM_THREADS
+
+// Blocks up to this size (bytes) are served from the thread caches
+static const size_t tcache_max_size = 256;
+
+// Number of blocks moved between a thread cache and the heap at once
+static const unsigned tcache_batch = 16;
+
+// A thread cache holding more blocks of one size drains half of them
+static const unsigned tcache_limit = 64;
+
+// One list per block size 16, 32, ..., tcache_max_size
+#define TCACHE_CLASSES (256 / 16)
+
+// Number of owner ids; 0 means a block has no owner
+#define TCACHE_OWNERS 256
+
+// Shift of the owner bits of a header
+static const int owner_shift = 48;
+
+// Mask to extract the owner bits from a header
+static const word_t owner_mask = ~(((word_t) 1 << 48) - 1);
+
+/*
+ * Cached blocks stay marked allocated in the heap, so neighbors never
+ * coalesce with them. The first payload word links them together; even
+ * a mini block has room for it.
+ */
+typedef struct {
+    block_t *list[TCACHE_CLASSES];
+    unsigned count[TCACHE_CLASSES];
+    unsigned id;        // owner id, 0 if the thread did not get one
+    bool registered;
+} tcache_t;
+
+/*
+ * Each thread cache that got an owner id has a remote free list: the
+ * blocks it handed out that other threads have freed since. They are
+ * pushed with a compare-and-swap and taken by the owner all at once, so
+ * a block allocated by one thread and freed by another goes back to the
+ * cache it came from without either thread taking heap_lock. When the
+ * owner exits the head becomes REMOTE_CLOSED again, and frees of its
+ * blocks go to the freeing thread's own cache until the id is given out
+ * again.
+ */
+typedef struct {
+    block_t *head;
+    bool claimed;
+} __attribute__((aligned(64))) remote_t;
+
+static char remote_closed_tag;
+#define REMOTE_CLOSED ((block_t *) &remote_closed_tag)
+
+// Lists of ids nobody has claimed are closed too, so a free that reads a
+// stale owner id from a header never pushes onto them
+static remote_t remote[TCACHE_OWNERS] = {
+    [0 ... TCACHE_OWNERS - 1] = { .head = REMOTE_CLOSED },
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+
+static __thread tcache_t tcache;
+
+/*
+ * tcache_index - Return the cache list for blocks of the given size
+ */
+static size_t tcache_index(size_t size)
+{
+    return size / dsize - 1;
+}
+
+/*
+ * tcache_push - Put an allocated block on the calling thread's cache
+ */
+static void tcache_push(block_t *block, size_t index)
+{
+    *(block_t **) header_to_payload(block) = tcache.list[index];
+    tcache.list[index] = block;
+    tcache.count[index]++;
+}
+
+/*
+ * tcache_pop - Take a block off the calling thread's cache
+ */
+static block_t *tcache_pop(size_t index)
+{
+    block_t *block = tcache.list[index];
+    tcache.list[index] = *(block_t **) header_to_payload(block);
+    tcache.count[index]--;
+    return block;
+}
+
+/*
+ * tcache_drain - Return cached blocks of one size to the heap until only
+ * keep are left. Must be called with heap_lock held.
+ */
+static void tcache_drain(size_t index, unsigned keep)
+{
+    while (tcache.count[index] > keep)
+        heap_free(header_to_payload(tcache_pop(index)));
+}
+
+/*
+ * tcache_collect - Put the blocks of a remote free list on the calling
+ * thread's cache
+ */
+static void tcache_collect(block_t *list)
+{
+    while (list != NULL) {
+        block_t *block = list;
+        list = *(block_t **) header_to_payload(block);
+
+        // The lock holder may be updating the prev bits of this header
+        word_t header = __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+        tcache_push(block, tcache_index(extract_size(header)));
+    }
+}
+
+/*
+ * tcache_reclaim - Move the blocks other threads freed to the calling
+ * thread's cache, draining any size that is then over tcache_limit.
+ * Returns false if there were none.
+ */
+static bool tcache_reclaim(void)
+{
+    if (tcache.id == 0 || __atomic_load_n(&remote[tcache.id].head, __ATOMIC_RELAXED) == NULL)
+        return false;
+
+    tcache_collect(__atomic_exchange_n(&remote[tcache.id].head, NULL, __ATOMIC_ACQUIRE));
+
+    bool locked = false;
+    for (size_t i = 0; i < TCACHE_CLASSES; i++) {
+        if (tcache.count[i] > tcache_limit) {
+            if (!locked)
+                pthread_mutex_lock(&heap_lock);
+            locked = true;
+            tcache_drain(i, tcache_limit / 2);
+        }
+    }
+    if (locked)
+        pthread_mutex_unlock(&heap_lock);
+
+    return true;
+}
+
+/*
+ * remote_push - Push a block onto the remote free list of its owner.
+ * Returns false if the owner has exited.
+ */
+static bool remote_push(unsigned owner, block_t *block)
+{
+    block_t *head = __atomic_load_n(&remote[owner].head, __ATOMIC_RELAXED);
+
+    do {
+        if (head == REMOTE_CLOSED)
+            return false;
+        *(block_t **) header_to_payload(block) = head;
+    } while (!__atomic_compare_exchange_n(&remote[owner].head, &head, block, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+/*
+ * tcache_exit - Thread exit destructor that gives the cache back to the
+ * heap. The remote free list is closed first, so no block can be pushed
+ * onto it afterwards, and then emptied with the rest.
+ */
+static void tcache_exit(void *arg)
+{
+    (void) arg;
+
+    if (tcache.id != 0) {
+        tcache_collect(__atomic_exchange_n(&remote[tcache.id].head, REMOTE_CLOSED,
+                                           __ATOMIC_ACQUIRE));
+        __atomic_store_n(&remote[tcache.id].claimed, false, __ATOMIC_RELEASE);
+        tcache.id = 0;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    for (size_t i = 0; i < TCACHE_CLASSES; i++)
+        tcache_drain(i, 0);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void tcache_create_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * tcache_register - Set up the exit destructor for the calling thread's
+ * cache and claim an owner id for it. With all ids taken the thread does
+ * without one, and frees of its blocks stay in the freeing thread.
+ */
+static void tcache_register(void)
+{
+    pthread_once(&tcache_once, tcache_create_key);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = true;
+
+    for (unsigned id = 1; id < TCACHE_OWNERS; id++) {
+        bool unclaimed = false;
+        if (__atomic_compare_exchange_n(&remote[id].claimed, &unclaimed, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            // The list is closed while the id is unclaimed
+            __atomic_store_n(&remote[id].head, NULL, __ATOMIC_RELEASE);
+            tcache.id = id;
+            return;
+        }
+    }
+}
+
+/*
+ * tcache_refill - Move a batch of blocks of the given size from the heap
+ * into the calling thread's cache. Each block's header is stamped with
+ * the cache's owner id, replacing any it had; heap_free clears it again
+ * when the block goes back to the heap. Returns false if the heap is full.
+ */
+static bool tcache_refill(size_t asize)
+{
+    size_t index = tcache_index(asize);
+
+    if (!tcache.registered)
+        tcache_register();
+
+    pthread_mutex_lock(&heap_lock);
+    for (unsigned i = 0; i < tcache_batch; i++) {
+        // Ask for a payload that rounds up to exactly asize
+        void *bp = heap_malloc(asize - wsize);
+        if (bp == NULL)
+            break;
+        block_t *block = payload_to_header(bp);
+        block->header = (block->header & ~owner_mask) | (word_t) tcache.id << owner_shift;
+        tcache_push(block, index);
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    return tcache.list[index] != NULL;
+}
+
+/*
+ * thread_malloc - mm_malloc for MM_THREADS builds: small requests come
+ * from the thread's cache and huge ones from mmap, neither taking the
+ * heap lock
+ */
+static void *thread_malloc(size_t size)
+{
+    // Huge blocks never touch the heap, so they need no lock
+    if (use_mmap(size))
+        return huge_malloc(size, dsize);
+
+    if (size != 0 && adjust_size(size) <= tcache_max_size) {
+        size_t asize = adjust_size(size);
+        size_t index = tcache_index(asize);
+
+        // Blocks freed by other threads come back before the heap is asked
+        if (tcache.list[index] == NULL && !(tcache_reclaim() && tcache.list[index] != NULL)
+            && !tcache_refill(asize))
+            return NULL;
+        return header_to_payload(tcache_pop(index));
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    void *bp = heap_malloc(size);
+    pthread_mutex_unlock(&heap_lock);
+    return bp;
+}
+
+#endif /* MM_THREADS */
+
+/*
+ * mm_init - Initialize the memory manager. In MM_THREADS builds it must
+ * not run while other threads are using the allocator.
+ */
+int mm_init(void)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    // The blocks this thread had cached, and those on the remote free
+    // lists, belong to the old heap
+    memset(tcache.list, 0, sizeof(tcache.list));
+    memset(tcache.count, 0, sizeof(tcache.count));
+    default_heap.region = mem_default_region();
+    for (size_t i = 0; i < TCACHE_OWNERS; i++) {
+        bool claimed = __atomic_load_n(&remote[i].claimed, __ATOMIC_RELAXED);
+        __atomic_store_n(&remote[i].head, claimed ? NULL : REMOTE_CLOSED, __ATOMIC_RELAXED);
+    }
+    int result = heap_init();
+    pthread_mutex_unlock(&heap_lock);
+    return result;
+#else
+    default_heap.region = mem_default_region();
+    return heap_init();
+#endif
+}
+
+/*
+ * mm_attach - Initialize the memory manager from a heap that memlib
+ * reopened with mem_init_file, instead of starting an empty one; see
+ * heap_attach. Every block that was allocated when mm_checkpoint ran is
+ * still allocated, at the same address, except huge blocks, whose mmap
+ * regions did not survive. Returns 0 on success and -1 if the heap cannot
+ * be resumed, after which mm_init starts over.
+ */
+int mm_attach(void)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    memset(tcache.list, 0, sizeof(tcache.list));
+    memset(tcache.count, 0, sizeof(tcache.count));
+    default_heap.region = mem_default_region();
+    int result = heap_attach();
+    pthread_mutex_unlock(&heap_lock);
+    return result;
+#else
+    default_heap.region = mem_default_region();
+    return heap_attach();
+#endif
+}
+
+/*
+ * mm_checkpoint - Make a file-backed heap ready to be resumed with
+ * mm_attach after memlib has closed it; see heap_checkpoint. In
+ * MM_THREADS builds the calling thread's cache goes back to the heap
+ * first, and no other thread may be using the allocator. Returns 0 on
+ * success and -1 if the heap is not file-backed.
+ */
+int mm_checkpoint(void)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    for (size_t i = 0; i < TCACHE_CLASSES; i++)
+        tcache_drain(i, 0);
+    int result = heap_checkpoint();
+    pthread_mutex_unlock(&heap_lock);
+    return result;
+#else
+    return heap_checkpoint();
+#endif
+}
+
+/*
+ * mm_malloc - Allocate a block with at least size bytes of payload
+ */
+void *mm_malloc(size_t size)
+{
+    prof_malloc(size, 1);
+#ifdef MM_THREADS
+    return thread_malloc(size);
+#else
+    return heap_malloc(size);
+#endif
+}
+
+/*
+ * mm_realloc - Resize an allocated block, see heap_realloc
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    // Counted as freeing the old block and asking for a new one
+    prof_free(ptr);
+    prof_malloc(size, 1);
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    void *bp = heap_realloc(ptr, size);
+    pthread_mutex_unlock(&heap_lock);
+    return bp;
+#else
+    return heap_realloc(ptr, size);
+#endif
+}
+
+/*
+ * mm_calloc - Allocate zeroed memory, see heap_calloc
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+        return NULL;
+
+    prof_malloc(nmemb * size, 1);
+#ifdef MM_THREADS
+    if (use_mmap(nmemb * size))
+        return huge_malloc(nmemb * size, dsize);
+
+    // Cached blocks are not fresh memory, so small requests are cleared here
+    if (nmemb * size != 0 && adjust_size(nmemb * size) <= tcache_max_size) {
+        void *bp = thread_malloc(nmemb * size);
+        if (bp != NULL)
+            memset(bp, 0, nmemb * size);
+        return bp;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    void *bp = heap_calloc(nmemb, size);
+    pthread_mutex_unlock(&heap_lock);
+    return bp;
+#else
+    return heap_calloc(nmemb, size);
+#endif
+}
+
+/*
+ * mm_memalign - Allocate memory aligned to align bytes, a power of two,
+ * see heap_memalign. Returns NULL with errno set to EINVAL if align is
+ * not a power of two.
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    prof_malloc(size, 1);
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    void *bp = heap_memalign(align, size);
+    pthread_mutex_unlock(&heap_lock);
+    return bp;
+#else
+    return heap_memalign(align, size);
+#endif
+}
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc on top of mm_memalign. Like glibc,
+ * it does not insist on size being a multiple of align.
+ */
+void *mm_aligned_alloc(size_t align, size_t size)
+{
+    return mm_memalign(align, size);
+}
+
+/*
+ * mm_check_level - Set how much of the heap is checked on each request,
+ * see MM_CHECK_LEVEL. Returns the previous level.
+ */
+int mm_check_level(int level)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    int old = check_level;
+    check_level = level;
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return old;
+}
+
+/*
+ * mm_profile_dump - Write the heap profile to fp as JSON, see
+ * heap_profile_dump. Returns 0 on success and -1 on a write error.
+ */
+int mm_profile_dump(FILE *fp)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    int result = heap_profile_dump(fp);
+    pthread_mutex_unlock(&heap_lock);
+    return result;
+#else
+    return heap_profile_dump(fp);
+#endif
+}
+
+/*
+ * mm_trim - Release the free memory at the end of the heap, keeping pad
+ * bytes of it for future requests. Returns 1 if memory was released and
+ * 0 otherwise.
+ */
+int mm_trim(size_t pad)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    bool released = heap_trim(pad);
+    pthread_mutex_unlock(&heap_lock);
+    return released;
+#else
+    return heap_trim(pad);
+#endif
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of at least size bytes each, see
+ * heap_malloc_batch. Returns the number of pointers stored in ptrs.
+ */
+size_t mm_malloc_batch(size_t size, void **ptrs, size_t n)
+{
+    prof_malloc(size, n);
+#ifdef MM_THREADS
+    pthread_mutex_lock(&heap_lock);
+    size_t done = heap_malloc_batch(size, ptrs, n);
+    pthread_mutex_unlock(&heap_lock);
+    return done;
+#else
+    return heap_malloc_batch(size, ptrs, n);
+#endif
+}
+
+/*
+ * mm_free_batch - Free n blocks at once, see heap_free_batch
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        prof_free(ptrs[i]);
+#ifdef MM_THREADS
+    // Batches bypass the thread caches and go straight to the heap
+    pthread_mutex_lock(&heap_lock);
+    heap_free_batch(ptrs, n);
+    pthread_mutex_unlock(&heap_lock);
+#else
+    heap_free_batch(ptrs, n);
+#endif
+}
+
+/*
+ * mm_free - Free a block
+ */
+void mm_free(void *bp)
+{
+    prof_free(bp);
+#ifdef MM_THREADS
+    if (bp == NULL)
+        return;
+
+    // The lock holder may be updating the prev bits of this header
+    block_t *block = payload_to_header(bp);
+    word_t header = __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+    size_t size = extract_size(header);
+
+    if (header & mmap_mask) {
+        huge_free(block);
+        return;
+    }
+
+    if (size <= tcache_max_size) {
+        size_t index = tcache_index(size);
+        unsigned owner = header >> owner_shift;
+
+        // A block from another thread's cache goes back to that cache
+        if (owner != 0 && owner != tcache.id && remote_push(owner, block))
+            return;
+
+        // A thread that only frees still needs its cache emptied on exit
+        if (!tcache.registered)
+            tcache_register();
+
+        tcache_push(block, index);
+        if (tcache.count[index] > tcache_limit) {
+            pthread_mutex_lock(&heap_lock);
+            tcache_drain(index, tcache_limit / 2);
+            pthread_mutex_unlock(&heap_lock);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    heap_free(bp);
+    pthread_mutex_unlock(&heap_lock);
+#else
+    heap_free(bp);
+#endif
+}
+
+/*
+ *****************************************************************************
+ * Extra heaps. Each mm_heap_t has a memlib region, free lists, profile     *
+ * and checking state of its own, so heaps share nothing and a heap can be  *
+ * thrown away with everything in it in one call. An extra heap takes no    *
+ * lock and keeps no thread caches, even in MM_THREADS builds: it must be   *
+ * used by one thread at a time, and blocks go back to the heap they came   *
+ * from. Huge requests are served from the region like any other, so that   *
+ * mm_heap_destroy does release all of a heap's memory.                     *
+ *****************************************************************************
+ */
+
+/*
+ * mm_heap_create - Make a new heap that can grow to about size bytes.
+ * Its memory is only backed once used. Returns NULL on failure.
+ */
+mm_heap_t *mm_heap_create(size_t size)
+{
+    size_t header = round_up(sizeof(mm_heap_t), dsize);
+
+    if (size > SIZE_MAX - header - chunksize)
+        return NULL;
+
+    mem_region_t *region = mem_region_create(header + size + chunksize);
+    if (region == NULL)
+        return NULL;
+
+    // The region starts out zero-filled, which is all the struct needs
+    // before heap_init fills it in
+    mm_heap_t *h = mem_region_sbrk(region, header);
+    h->region = region;
+    h->mmap_threshold = 0;
+
+    mm_heap_t *from = heap_switch(h);
+    int result = heap_init();
+    heap_switch(from);
+
+    if (result < 0) {
+        mem_region_destroy(region);
+        return NULL;
+    }
+    return h;
+}
+
+/*
+ * mm_heap_destroy - Release a heap made by mm_heap_create, and every
+ * block still allocated from it
+ */
+void mm_heap_destroy(mm_heap_t *h)
+{
+    mem_region_destroy(h->region);
+}
+
+/*
+ * mm_heap_malloc - mm_malloc from heap h
+ */
+void *mm_heap_malloc(mm_heap_t *h, size_t size)
+{
+    mm_heap_t *from = heap_switch(h);
+    prof_malloc(size, 1);
+    void *bp = heap_malloc(size);
+    heap_switch(from);
+    return bp;
+}
+
+/*
+ * mm_heap_calloc - mm_calloc from heap h
+ */
+void *mm_heap_calloc(mm_heap_t *h, size_t nmemb, size_t size)
+{
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+        return NULL;
+
+    mm_heap_t *from = heap_switch(h);
+    prof_malloc(nmemb * size, 1);
+    void *bp = heap_calloc(nmemb, size);
+    heap_switch(from);
+    return bp;
+}
+
+/*
+ * mm_heap_realloc - mm_realloc of a block of heap h
+ */
+void *mm_heap_realloc(mm_heap_t *h, void *ptr, size_t size)
+{
+    mm_heap_t *from = heap_switch(h);
+    prof_free(ptr);
+    prof_malloc(size, 1);
+    void *bp = heap_realloc(ptr, size);
+    heap_switch(from);
+    return bp;
+}
+
+/*
+ * mm_heap_free - mm_free of a block of heap h
+ */
+void mm_heap_free(mm_heap_t *h, void *ptr)
+{
+    mm_heap_t *from = heap_switch(h);
+    prof_free(ptr);
+    heap_free(ptr);
+    heap_switch(from);
+}
+
+/*
+ * mm_heap_profile_dump - mm_profile_dump for heap h
+ */
+int mm_heap_profile_dump(mm_heap_t *h, FILE *fp)
+{
+    mm_heap_t *from = heap_switch(h);
+    int result = heap_profile_dump(fp);
+    heap_switch(from);
+    return result;
+}
+
+/*
+ * find_class - Return the index of the segregated list that holds blocks
+ * of the given size. Sizes up to small_class_max map to one class per
+ * 16 bytes; larger sizes map to power-of-two classes.
+ */
+static size_t find_class(size_t size)
+{
+    size_t index;
+
+    if (size <= small_class_max) {
+        index = (size - min_block_size) / dsize;
+    } else {
+        index = num_small_classes;
+        for (size_t limit = 2 * small_class_max; size > limit; limit <<= 1)
+            index++;
+    }
+
+    return (index < MM_NUM_CLASSES) ? index : MM_NUM_CLASSES - 1;
+}
+
+/*
+ * insert_block - Insert block at the head of its size class list (e.g., LIFO policy)
+ */
+static void insert_block(block_t *free_block)
+{
+    if (get_size(free_block) == mini_block_size) {
+        block_t *head = heap->mini_list;
+
+        mini_set_links(free_block, NULL, head);
+        if (head != NULL)
+            mini_set_links(head, free_block, mini_get_next(head));
+        heap->mini_list = free_block;
+        return;
+    }
+
+    if (in_tree(get_size(free_block))) {
+        tree_insert(free_block);
+        return;
+    }
+
+    size_t index = find_class(get_size(free_block));
+    block_t *head = heap->seg_list[index];
+
+    free_block->payload.links.prev = NULL;
+    free_block->payload.links.next = head;
+    if (head != NULL)
+        head->payload.links.prev = free_block;
+    heap->seg_list[index] = free_block;
+}
+
+/*
+ * remove_block - Remove a free block from its size class list in O(1)
+ * using the block's own prev/next links
+ */
+static void remove_block(block_t *free_block)
+{
+    if (get_size(free_block) == mini_block_size) {
+        block_t *prev = mini_get_prev(free_block);
+        block_t *next = mini_get_next(free_block);
+
+        if (prev != NULL)
+            mini_set_links(prev, mini_get_prev(prev), next);
+        else
+            heap->mini_list = next;
+        if (next != NULL)
+            mini_set_links(next, prev, mini_get_next(next));
+        return;
+    }
+
+    if (in_tree(get_size(free_block))) {
+        tree_remove(free_block);
+        return;
+    }
+
+    size_t index = find_class(get_size(free_block));
+    block_t *prev = free_block->payload.links.prev;
+    block_t *next = free_block->payload.links.next;
+
+#if MM_FIT_POLICY == FIT_NEXT
+    if (heap->rover[index] == free_block)
+        heap->rover[index] = next;
+#endif
+
+    // Unlink in place; a NULL prev means the block is the head of its list
+    if (prev != NULL)
+        prev->payload.links.next = next;
+    else
+        heap->seg_list[index] = next;
+
+    if (next != NULL)
+        next->payload.links.prev = prev;
+}
+
+/*
+ * mini_ref - Return the 32-bit reference to a free mini block that is
+ * kept in its neighbors' links: its distance from the start of the heap
+ * in dsize units, plus one so that 0 stands for NULL. The references are
+ * relative, so they stay valid when a file-backed heap is mapped back in.
+ */
+static word_t mini_ref(block_t *block)
+{
+    if (block == NULL)
+        return 0;
+    return (word_t) ((unsigned char *) block - (unsigned char *) heap->heap_start) / dsize + 1;
+}
+
+/*
+ * mini_deref - Return the free mini block that ref refers to
+ */
+static block_t *mini_deref(word_t ref)
+{
+    if (ref == 0)
+        return NULL;
+    return (block_t *) ((unsigned char *) heap->heap_start + (ref - 1) * dsize);
+}
+
+/*
+ * mini_get_next - Return the next block on the free mini list
+ */
+static block_t *mini_get_next(block_t *block)
+{
+    return mini_deref(block->payload.mini_links & 0xFFFFFFFF);
+}
+
+/*
+ * mini_get_prev - Return the previous block on the free mini list
+ */
+static block_t *mini_get_prev(block_t *block)
+{
+    return mini_deref(block->payload.mini_links >> 32);
+}
+
+/*
+ * mini_set_links - Set both links of a free mini block
+ */
+static void mini_set_links(block_t *block, block_t *prev, block_t *next)
+{
+    block->payload.mini_links = mini_ref(prev) << 32 | mini_ref(next);
+}
+
+/*
+ * Finds a free block that of size at least asize. The search starts at the
+ * class for asize and moves to larger classes until a fit is found, then
+ * falls back to the best fit among the large blocks in the tree.
+ */
+static block_t *find_fit(size_t asize)
+{
+    if (asize == mini_block_size) {
+        if (heap->mini_list != NULL)
+            return heap->mini_list;
+        asize = min_block_size;
+    }
+
+    if (!in_tree(asize)) {
+        for (size_t index = find_class(asize); index < MM_NUM_CLASSES; index++) {
+            block_t *block = search_class(index, asize);
+            if (block != NULL)
+                return block;
+        }
+    }
+
+    return tree_find_fit(asize);
+}
+
+/*
+ * search_class - Pick a block of at least asize from one size class
+ * according to MM_FIT_POLICY. Returns NULL if none in the class fits.
+ */
+static block_t *search_class(size_t index, size_t asize)
+{
+#if MM_FIT_POLICY == FIT_NEXT
+    // Search from the rover to the end of the list, then wrap to the head
+    block_t *start = heap->rover[index] ? heap->rover[index] : heap->seg_list[index];
+    block_t *curr = start;
+
+    while (curr != NULL) {
+        if (asize <= get_size(curr)) {
+            heap->rover[index] = curr;
+            return curr;
+        }
+        curr = curr->payload.links.next;
+        if (curr == NULL && start != heap->seg_list[index])
+            curr = heap->seg_list[index];
+        if (curr == start)
+            break;
+    }
+
+    return NULL;
+#elif MM_FIT_POLICY == FIT_BEST
+    // Every block in a larger class is bigger than any fit found here, so
+    // the best fit within this class is the answer
+    block_t *best = NULL;
+    unsigned candidates = 0;
+
+    for (block_t *curr = heap->seg_list[index]; curr != NULL; curr = curr->payload.links.next) {
+        size_t size = get_size(curr);
+
+        if (asize <= size) {
+            if (best == NULL || size < get_size(best))
+                best = curr;
+            if (size == asize || ++candidates == MM_BEST_FIT_K)
+                break;
+        }
+    }
+
+    return best;
+#else
+    for (block_t *curr = heap->seg_list[index]; curr != NULL; curr = curr->payload.links.next) {
+        if (asize <= get_size(curr))
+            return curr;
+    }
+
+    return NULL;
+#endif
+}
+
+/*
+ * in_tree - Return whether free blocks of this size live in the tree
+ */
+static bool in_tree(size_t size)
+{
+#if MM_TREE_MIN_SIZE == 0
+    (void) size;
+    return false;
+#else
+    return size >= MM_TREE_MIN_SIZE;
+#endif
+}
+
+/*
+ * tree_compare - Order a (size, address) key against a tree node
+ */
+static int tree_compare(size_t size, block_t *addr, block_t *node)
+{
+    size_t node_size = get_size(node);
 
-    return bp;
+    if (size != node_size)
+        return (size < node_size) ? -1 : 1;
+    if (addr != node)
+        return (addr < node) ? -1 : 1;
+    return 0;
 }
 
-
 /*
- * mm_free - Free a block
+ * tree_splay - Top-down splay of the tree rooted at root for the key
+ * (size, addr). Returns the new root: the node with that key if there is
+ * one, and otherwise the last node on the search path, which is the key's
+ * predecessor or successor.
  */
-void mm_free(void *bp)
+static block_t *tree_splay(block_t *root, size_t size, block_t *addr)
 {
-    if (bp == NULL)
-        return;
+    block_t side;   // Only the tree links are used
+    block_t *left = &side, *right = &side;
+    block_t *node;
 
-    // TODO: Implement mm_free
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
+    if (root == NULL)
+        return NULL;
 
-    // The block should be marked as allocated
-    if (!get_alloc(block)) {
-        fprintf(stderr, "ERROR.  Attempted to free unallocated block\n");
-        exit(1);
+    side.payload.tree.left = side.payload.tree.right = NULL;
+
+    for (;;) {
+        int cmp = tree_compare(size, addr, root);
+
+        if (cmp < 0) {
+            if (root->payload.tree.left == NULL)
+                break;
+            if (tree_compare(size, addr, root->payload.tree.left) < 0) {
+                // Rotate right
+                node = root->payload.tree.left;
+                root->payload.tree.left = node->payload.tree.right;
+                node->payload.tree.right = root;
+                root = node;
+                if (root->payload.tree.left == NULL)
+                    break;
+            }
+            // Link right
+            right->payload.tree.left = root;
+            right = root;
+            root = root->payload.tree.left;
+        } else if (cmp > 0) {
+            if (root->payload.tree.right == NULL)
+                break;
+            if (tree_compare(size, addr, root->payload.tree.right) > 0) {
+                // Rotate left
+                node = root->payload.tree.right;
+                root->payload.tree.right = node->payload.tree.left;
+                node->payload.tree.left = root;
+                root = node;
+                if (root->payload.tree.right == NULL)
+                    break;
+            }
+            // Link left
+            left->payload.tree.right = root;
+            left = root;
+            root = root->payload.tree.right;
+        } else {
+            break;
+        }
     }
 
-    // Mark the block as free
-    write_header(block, size, false);
-    write_footer(block, size, false);
-
-    // add the block to the free list
-    insert_block(block);
+    // Reassemble
+    left->payload.tree.right = root->payload.tree.left;
+    right->payload.tree.left = root->payload.tree.right;
+    root->payload.tree.left = side.payload.tree.right;
+    root->payload.tree.right = side.payload.tree.left;
 
-    // Try to coalesce the block with its neighbors
-    coalesce_block(block);
+    return root;
 }
 
 /*
- * insert_block - Insert block at the head of the free list (e.g., LIFO policy)
+ * tree_insert - Add a large free block to the tree
  */
-static void insert_block(block_t *free_block)
+static void tree_insert(block_t *block)
 {
-  	// TODO: Implement insert block on the free list
-    free_block->payload.links.prev = NULL;
-    free_block->payload.links.next = free_list_head;
-    free_list_head->payload.links.prev = free_block;
-    free_list_head = free_block;
+    size_t size = get_size(block);
+    block_t *root = tree_splay(heap->tree_root, size, block);
+
+    if (root == NULL) {
+        block->payload.tree.left = block->payload.tree.right = NULL;
+    } else if (tree_compare(size, block, root) < 0) {
+        block->payload.tree.left = root->payload.tree.left;
+        block->payload.tree.right = root;
+        root->payload.tree.left = NULL;
+    } else {
+        block->payload.tree.right = root->payload.tree.right;
+        block->payload.tree.left = root;
+        root->payload.tree.right = NULL;
+    }
+
+    heap->tree_root = block;
 }
 
 /*
- * remove_block - Remove a free block from the free list
+ * tree_remove - Take a large free block out of the tree
  */
-static void remove_block(block_t *free_block)
+static void tree_remove(block_t *block)
 {
-    // TODO: Implement remove block from the free list
-    block_t* curr = free_list_head;
-    block_t* prev = NULL;
-    block_t* next = NULL;
+    size_t size = get_size(block);
+    block_t *root = tree_splay(heap->tree_root, size, block);   // root == block
 
-    while (curr != NULL) {
-      if (curr == free_block) {
-        prev = curr->payload.links.prev;
-        next = curr->payload.links.next;
-        if (prev != NULL) {
-          prev->payload.links.next = next;
-        }
-        if (next != NULL) {
-          next->payload.links.next = prev;
-        }
-      }
-      curr = curr->payload.links.next;
+    if (root->payload.tree.left == NULL) {
+        heap->tree_root = root->payload.tree.right;
+    } else {
+        // The largest block on the left becomes the root; it has no right child
+        heap->tree_root = tree_splay(root->payload.tree.left, size, block);
+        heap->tree_root->payload.tree.right = root->payload.tree.right;
     }
 }
 
 /*
- * Finds a free block that of size at least asize
+ * tree_find_fit - Return the smallest block in the tree of at least asize
+ * bytes, or NULL if there is none
  */
-static block_t *find_fit(size_t asize)
+static block_t *tree_find_fit(size_t asize)
 {
-    // TODO: Implement find_fit.  You should start with a simple first-fit policy.
-    block_t* curr = free_list_head;
-    block_t* result = NULL;
+    // No block is at address NULL, so this key sorts before every block of
+    // size asize
+    heap->tree_root = tree_splay(heap->tree_root, asize, NULL);
 
-    while (curr != NULL) {
-      if (asize <= get_size(curr)) {
-        result = curr;
-        break;
-      }
-      curr = curr->payload.links.next;
-    }
+    block_t *block = heap->tree_root;
+    if (block == NULL || get_size(block) >= asize)
+        return block;
 
-    return result;
+    // The root is the predecessor; the fit is the smallest node to its right
+    block = block->payload.tree.right;
+    while (block != NULL && block->payload.tree.left != NULL)
+        block = block->payload.tree.left;
+
+    return block;
 }
 
 /*
  * Coalesces current block with previous and next blocks if either or both are unallocated; otherwise the block is not modified.
+ * The block must not be on a free list; free neighbors are taken off theirs.
  * Returns pointer to the coalesced block. After coalescing, the immediate contiguous previous and next blocks must be allocated.
  */
 static block_t *coalesce_block(block_t *block)
 {
-	  // TODO: Implement block coalescing
     size_t size = get_size(block);
-    block_t* result = block;
 
     block_t *block_next = find_next(block);
-    block_t *block_prev = find_prev(block);
 
-    bool prev_alloc = extract_alloc(*find_prev_footer(block));
+    bool prev_alloc = get_prev_alloc(block);
     bool next_alloc = get_alloc(block_next);
 
-    if (prev_alloc && !next_alloc) {
-        remove_block(block);
-
+    if (!next_alloc) {
+        remove_block(block_next);
         size += get_size(block_next);
-        write_header(block, size, false);
-        write_footer(block, size, false);
-
-        insert_block(block);
     }
 
-    if (!prev_alloc && next_alloc) {
-        remove_block(block);
-
+    if (!prev_alloc) {
+        block_t *block_prev = find_prev(block);
+        remove_block(block_prev);
         size += get_size(block_prev);
-        write_header(block_prev, size, false);
-        write_footer(block_prev, size, false);
         block = block_prev;
-
-        insert_block(block);
     }
 
-    if (!prev_alloc && !next_alloc) {
-        remove_block(block);
-
-        size += get_size(block_next) + get_size(block_prev);
-        write_header(block_prev, size, false);
-        write_footer(block_prev, size, false);
-        block = block_prev;
-
-        insert_block(block);
+    if (!prev_alloc || !next_alloc) {
+        // A free block always follows an allocated one after coalescing
+        write_header(block, size, true, get_prev_mini(block), false);
+        write_footer(block, size, false);
+        write_next_prev(block);
+        check_forget(block, size);
     }
 
-    return result;
+    return block;
 }
 
 /*
@@ -403,17 +2760,20 @@ static block_t *coalesce_block(block_t *block)
  */
 static void split_block(block_t *block, size_t asize)
 {
-	 // TODO: Implement block splitting
-   size_t block_size = get_size(block);
+    size_t block_size = get_size(block);
 
-    if ((block_size - asize) >= min_block_size) {
+    if ((block_size - asize) >= mini_block_size) {
         block_t *block_next;
-        write_header(block, asize, true);
-        write_footer(block, asize, true);
+        write_header(block, asize, get_prev_alloc(block), get_prev_mini(block), true);
 
         block_next = find_next(block);
-        write_header(block_next, block_size - asize, false);
+        write_header(block_next, block_size - asize, true,
+                     asize == mini_block_size, false);
         write_footer(block_next, block_size - asize, false);
+        write_next_prev(block_next);
+
+        // When shrinking in place, the block after may already be free
+        block_next = coalesce_block(block_next);
         insert_block(block_next);
     }
 }
@@ -421,8 +2781,9 @@ static void split_block(block_t *block, size_t asize)
 
 /*
  * Extends the heap with the requested number of bytes, and recreates end header.
- * Returns a pointer to the result of coalescing the newly-created block with previous free block,
- * if applicable, or NULL in failure.
+ * The new free block is coalesced with a free block at the end of the heap
+ * and placed on its free list.
+ * Returns a pointer to the resulting free block, or NULL in failure.
  */
 static block_t *extend_heap(size_t size)
 {
@@ -430,21 +2791,32 @@ static block_t *extend_heap(size_t size)
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
+    if (size > mini_reach - mem_region_size(heap->region))
+        return NULL;
+    if ((bp = mem_region_sbrk(heap->region, size)) == (void *)-1) {
         return NULL;
     }
 
-    // bp is a pointer to the new memory block requested
+#ifdef MM_PROFILE
+    heap->prof.extends++;
+    heap->prof.extend_bytes += size;
+#endif
+
+    // bp is a pointer to the new memory block requested. The old epilogue
+    // header becomes the header of the new free block.
+    block_t *block = payload_to_header(bp);
+    write_header(block, size, get_prev_alloc(block), get_prev_mini(block), false);
+    write_footer(block, size, false);
 
-    // TODO: Implement extend_heap.
-    // You will want to replace this return statement...
-    block_t* result = payload_to_header(bp);
-    size_t block_size = sizeof(result);
+    // Create the new epilogue header
+    block_t *block_next = find_next(block);
+    write_header(block_next, 0, false, false, true);
+    heap->epilogue = block_next;
 
-    write_header(result + (block_size - 1), 0, true);
-    heap_start = result;
+    block = coalesce_block(block);
+    insert_block(block);
 
-    return result;
+    return block;
 }
 
 /******** The remaining content below are helper and debug routines ********/
@@ -455,7 +2827,7 @@ static block_t *extend_heap(size_t size)
  */
 static int in_heap(const void* p)
 {
-    return p <= mem_heap_hi() && p >= mem_heap_lo();
+    return p <= mem_region_hi(heap->region) && p >= mem_region_lo(heap->region);
 }
 
 /*
@@ -465,10 +2837,15 @@ static void examine_heap() {
   block_t *block;
 
   /* print to stderr so output isn't buffered and not output if we crash */
-  fprintf(stderr, "free_list_head: %p\n", (void *)free_list_head);
+  for (size_t i = 0; i < MM_NUM_CLASSES; i++) {
+    if (heap->seg_list[i] != NULL)
+      fprintf(stderr, "seg_list[%zu]: %p\n", i, (void *)heap->seg_list[i]);
+  }
+  fprintf(stderr, "mini_list: %p\n", (void *)heap->mini_list);
+  fprintf(stderr, "tree_root: %p\n", (void *)heap->tree_root);
 
-  for (block = heap_start; /* first block on heap */
-      get_size(block) > 0 && block < (block_t*)mem_heap_hi();
+  for (block = heap->heap_start; /* first block on heap */
+      get_size(block) > 0 && block < (block_t*)mem_region_hi(heap->region);
       block = find_next(block)) {
 
     /* print out common block attributes */
@@ -477,6 +2854,14 @@ static void examine_heap() {
     /* and allocated/free specific data */
     if (get_alloc(block)) {
       fprintf(stderr, "ALLOCATED\n");
+    } else if (get_size(block) == mini_block_size) {
+      fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
+      (void *)mini_get_next(block),
+      (void *)mini_get_prev(block));
+    } else if (in_tree(get_size(block))) {
+      fprintf(stderr, "FREE\tleft: %p, right: %p\n",
+      (void *)block->payload.tree.left,
+      (void *)block->payload.tree.right);
     } else {
       fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
       (void *)block->payload.links.next,
@@ -487,38 +2872,470 @@ static void examine_heap() {
 }
 
 
-/* check_heap: checks the heap for correctness; returns true if
- *               the heap is correct, and false otherwise.
+/*
+ * prof_bucket - Return the size bucket [16 << b, 32 << b) holding size
  */
-static bool check_heap()
+static size_t prof_bucket(size_t size)
+{
+    if (size < 32)
+        return 0;
+    return min(63 - __builtin_clzl(size) - 4, PROF_BUCKETS - 1);
+}
+
+/*
+ * prof_malloc - Count n requests for size bytes each in the profile of
+ * the heap. In MM_PROFILE builds only; the counters are shared by all
+ * threads.
+ */
+static void prof_malloc(size_t size, size_t n)
+{
+#ifdef MM_PROFILE
+    if (size == 0)
+        return;
+
+    while (n >= prof_malloc_countdown) {
+        size_t b = prof_bucket(size < SIZE_MAX / 2 ? adjust_size(size) : size);
+
+        n -= prof_malloc_countdown;
+        prof_malloc_countdown = MM_PROFILE_RATE;
+        __atomic_fetch_add(&heap->prof.mallocs[b], MM_PROFILE_RATE, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&heap->prof.malloc_bytes[b], MM_PROFILE_RATE * size, __ATOMIC_RELAXED);
+    }
+    prof_malloc_countdown -= n;
+#else
+    (void) size;
+    (void) n;
+#endif
+}
+
+/*
+ * prof_free - Count freeing bp, which must still be allocated, in the
+ * profile of the heap
+ */
+static void prof_free(void *bp)
+{
+#ifdef MM_PROFILE
+    if (bp == NULL || --prof_free_countdown != 0)
+        return;
+    prof_free_countdown = MM_PROFILE_RATE;
+
+    size_t size;
+#ifdef MM_SMALL_PAGES
+    if (small_owns(bp))
+        size = ((small_page_t *) ((uintptr_t) bp & ~(uintptr_t) (SMALL_PAGE_SIZE - 1)))->obj_size;
+    else
+#endif
+    // The lock holder may be updating the prev bits of this header
+    size = extract_size(__atomic_load_n(&payload_to_header(bp)->header, __ATOMIC_RELAXED));
+
+    size_t b = prof_bucket(size);
+    __atomic_fetch_add(&heap->prof.frees[b], MM_PROFILE_RATE, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&heap->prof.free_bytes[b], MM_PROFILE_RATE * size, __ATOMIC_RELAXED);
+#else
+    (void) bp;
+#endif
+}
+
+/*
+ * heap_profile_dump - Write a JSON object describing the heap to fp: its
+ * size, a histogram of free block sizes by bucket and the external
+ * fragmentation, 1 - (largest free block / all free bytes), which is 0
+ * when all free memory is in one block and approaches 1 as it is spread
+ * over many small ones. Profiling builds add the sampled request and free
+ * counters per bucket and the heap growth counters. Blocks held on quick
+ * lists or thread caches count as allocated. Walks the whole heap, so it
+ * is meant to be called on demand, not on every request.
+ */
+static int heap_profile_dump(FILE *fp)
+{
+    size_t count[PROF_BUCKETS] = { 0 };
+    size_t bytes[PROF_BUCKETS] = { 0 };
+    size_t free_blocks = 0, free_bytes = 0, largest = 0;
+    size_t alloc_blocks = 0, alloc_bytes = 0;
+
+    for (block_t *block = heap->heap_start; get_size(block) > 0; block = find_next(block)) {
+        size_t size = get_size(block);
+
+        if (get_alloc(block)) {
+            alloc_blocks++;
+            alloc_bytes += size;
+            continue;
+        }
+        count[prof_bucket(size)]++;
+        bytes[prof_bucket(size)] += size;
+        free_blocks++;
+        free_bytes += size;
+        largest = max(largest, size);
+    }
+
+    fprintf(fp, "{\n  \"heap_bytes\": %zu,\n", mem_region_size(heap->region));
+    fprintf(fp, "  \"alloc_blocks\": %zu,\n  \"alloc_bytes\": %zu,\n", alloc_blocks, alloc_bytes);
+    fprintf(fp, "  \"free_blocks\": %zu,\n  \"free_bytes\": %zu,\n", free_blocks, free_bytes);
+    fprintf(fp, "  \"largest_free\": %zu,\n", largest);
+    fprintf(fp, "  \"fragmentation\": %.4f,\n",
+            free_bytes ? 1.0 - (double) largest / (double) free_bytes : 0.0);
+
+    fprintf(fp, "  \"free_histogram\": [");
+    const char *sep = "";
+    for (size_t b = 0; b < PROF_BUCKETS; b++) {
+        if (count[b] == 0)
+            continue;
+        fprintf(fp, "%s\n    {\"min\": %zu, \"blocks\": %zu, \"bytes\": %zu}",
+                sep, (size_t) 16 << b, count[b], bytes[b]);
+        sep = ",";
+    }
+    fprintf(fp, "\n  ]");
+
+#ifdef MM_PROFILE
+    fprintf(fp, ",\n  \"sample_rate\": %d,\n", MM_PROFILE_RATE);
+    fprintf(fp, "  \"heap_extends\": %zu,\n  \"heap_extend_bytes\": %zu,\n",
+            heap->prof.extends, heap->prof.extend_bytes);
+    fprintf(fp, "  \"classes\": [");
+    sep = "";
+    for (size_t b = 0; b < PROF_BUCKETS; b++) {
+        // Threads count requests without taking the heap lock
+        size_t mallocs = __atomic_load_n(&heap->prof.mallocs[b], __ATOMIC_RELAXED);
+        size_t malloc_bytes = __atomic_load_n(&heap->prof.malloc_bytes[b], __ATOMIC_RELAXED);
+        size_t frees = __atomic_load_n(&heap->prof.frees[b], __ATOMIC_RELAXED);
+        size_t freed_bytes = __atomic_load_n(&heap->prof.free_bytes[b], __ATOMIC_RELAXED);
+
+        if (mallocs == 0 && frees == 0)
+            continue;
+        fprintf(fp, "%s\n    {\"min\": %zu, \"mallocs\": %zu, \"malloc_bytes\": %zu, "
+                "\"frees\": %zu, \"free_bytes\": %zu}", sep, (size_t) 16 << b,
+                mallocs, malloc_bytes, frees, freed_bytes);
+        sep = ",";
+    }
+    fprintf(fp, "\n  ]");
+#endif
+
+    fprintf(fp, "\n}\n");
+
+    return ferror(fp) ? -1 : 0;
+}
+
+
+/* check_tree: walks the tree of large free blocks in order, checking that
+ *             every node is a free in-heap block that belongs in the tree
+ *             and that keys are strictly increasing. Adds the number of
+ *             nodes to *count. Uses a Morris traversal, which needs no
+ *             stack and leaves the tree as it found it.
+ */
+static bool check_tree(size_t *count)
+{
+    block_t *curr = heap->tree_root;
+    block_t *last = NULL;
+    bool ok = true;
+
+    while (curr != NULL) {
+        block_t *visit = NULL;
+
+        if (curr->payload.tree.left == NULL) {
+            visit = curr;
+            curr = curr->payload.tree.right;
+        } else {
+            block_t *pred = curr->payload.tree.left;
+            while (pred->payload.tree.right != NULL && pred->payload.tree.right != curr)
+                pred = pred->payload.tree.right;
+
+            if (pred->payload.tree.right == NULL) {
+                pred->payload.tree.right = curr;
+                curr = curr->payload.tree.left;
+            } else {
+                pred->payload.tree.right = NULL;
+                visit = curr;
+                curr = curr->payload.tree.right;
+            }
+        }
+
+        // Keep walking after an error so the threaded links are undone
+        if (visit != NULL && ok) {
+            if (!in_heap(visit) || get_alloc(visit) || !in_tree(get_size(visit))) {
+                printf("Bad block %p in the tree\n", (void *)visit);
+                ok = false;
+            } else if (last != NULL && tree_compare(get_size(visit), visit, last) <= 0) {
+                printf("Tree out of order at %p\n", (void *)visit);
+                ok = false;
+            }
+            last = visit;
+            (*count)++;
+        }
+    }
+
+    return ok;
+}
+
+
+/* check_free_lists: walks the mini list and the segregated free lists,
+ *                   checking that they hold free blocks of their class
+ *                   with consistent links, and adds their length to
+ *                   count. More than limit blocks in all means a cycle.
+ *                   Returns true if all hold.
+ */
+static bool check_free_lists(size_t limit, size_t *count)
+{
+    block_t *curr;
+    block_t *prev = NULL;
+
+    for (curr = heap->mini_list; curr != NULL; curr = mini_get_next(curr)) {
+        if (!in_heap(curr) || get_alloc(curr) || get_size(curr) != mini_block_size) {
+            printf("Bad block %p on the mini list\n", (void *)curr);
+            return false;
+        }
+        if (mini_get_prev(curr) != prev) {
+            printf("Mini block %p has prev %p, expected %p\n", (void *)curr,
+                   (void *)mini_get_prev(curr), (void *)prev);
+            return false;
+        }
+        if (++*count > limit) {
+            printf("Mini list is longer than the heap (cycle?)\n");
+            return false;
+        }
+        prev = curr;
+    }
+
+    for (size_t i = 0; i < MM_NUM_CLASSES; i++) {
+        prev = NULL;
+
+        for (curr = heap->seg_list[i]; curr != NULL; curr = curr->payload.links.next) {
+            if (!in_heap(curr)) {
+                printf("Free list %zu points outside the heap: %p\n", i, (void *)curr);
+                return false;
+            }
+            if (get_alloc(curr)) {
+                printf("Allocated block %p on free list %zu\n", (void *)curr, i);
+                return false;
+            }
+            if (find_class(get_size(curr)) != i) {
+                printf("Block %p of size %zu on wrong free list %zu\n",
+                       (void *)curr, get_size(curr), i);
+                return false;
+            }
+            if (curr->payload.links.prev != prev) {
+                printf("Block %p has prev %p, expected %p\n", (void *)curr,
+                       (void *)curr->payload.links.prev, (void *)prev);
+                return false;
+            }
+            if (++*count > limit) {
+                printf("Free list %zu is longer than the heap (cycle?)\n", i);
+                return false;
+            }
+            prev = curr;
+        }
+    }
+
+    return true;
+}
+
+
+/* check_block: checks one block and how it fits with its neighbors:
+ *              that it lies in the heap with an aligned payload, that its
+ *              successor's prev bits describe it, that a free block has a
+ *              matching footer and allocated neighbors, and that a free
+ *              predecessor ends right at the block. Returns true if all
+ *              hold. O(1) and inlined; this is check level 1.
+ */
+static inline bool check_block(block_t *block)
 {
+    block_t *epilogue = heap->epilogue;
+    size_t size = get_size(block);
+
+    if (block < heap->heap_start || block >= epilogue
+        || ((uintptr_t) header_to_payload(block) % dsize) != 0) {
+        printf("Block %p is not a block in the heap\n", (void *)block);
+        return false;
+    }
+
+    if (size < mini_block_size || size > (size_t) ((unsigned char *) epilogue - (unsigned char *) block)) {
+        printf("Block %p has a bad size %zu\n", (void *)block, size);
+        return false;
+    }
+
+    block_t *next = find_next(block);
+
+    if (get_prev_alloc(next) != get_alloc(block)
+        || get_prev_mini(next) != (size == mini_block_size)) {
+        printf("Block %p after %p has stale prev bits\n", (void *)next, (void *)block);
+        return false;
+    }
+
+    if (!get_alloc(block)) {
+        if (size > mini_block_size && *header_to_footer(block) != pack(size, false, false, false)) {
+            printf("Free block %p has a bad footer\n", (void *)block);
+            return false;
+        }
+        if (!get_prev_alloc(block) || !get_alloc(next)) {
+            printf("Free block %p escaped coalescing\n", (void *)block);
+            return false;
+        }
+    }
+
+    if (!get_prev_alloc(block)) {
+        block_t *prev = find_prev(block);
+
+        if (prev < heap->heap_start || prev >= block || get_alloc(prev) || find_next(prev) != block) {
+            printf("Block %p has a bad free predecessor %p\n", (void *)block, (void *)prev);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* check_segment: checks the next check_segment_blocks blocks after
+ *                check_cursor with check_block and advances the cursor,
+ *                wrapping to the start of the heap at the epilogue. This
+ *                is check level 2. check_forget keeps the cursor on a
+ *                block start as blocks merge.
+ */
+static bool check_segment(void)
+{
+    block_t *block = (heap->check_cursor != NULL) ? heap->check_cursor : heap->heap_start;
+
+    for (size_t i = 0; i < check_segment_blocks; i++) {
+        if (get_size(block) == 0) {
+            block = heap->heap_start;
+            if (get_size(block) == 0)
+                break;
+        }
+        if (!check_block(block))
+            return false;
+        block = find_next(block);
+    }
+
+    heap->check_cursor = (get_size(block) == 0) ? NULL : block;
+    return true;
+}
+
+/* check_request: runs the checks of the current level for a block being
+ *                allocated or freed, exiting if the heap is corrupt.
+ */
+static inline void check_request(block_t *block)
+{
+    bool ok = check_block(block);
+
+    if (ok && check_level == 2)
+        ok = check_segment();
+    if (ok && check_level >= 3)
+        ok = check_heap();
 
-    // Implement a heap consistency checker as needed.
+    if (!ok) {
+        fprintf(stderr, "ERROR.  Heap check failed at block %p\n", (void *)block);
+        exit(1);
+    }
+}
 
-    /* Below is an example, but you will need to write the heap checker yourself. */
+/* check_forget: called when the block at block grows to size bytes by
+ *               swallowing the blocks after it; a segment cursor that
+ *               pointed at one of them moves back to the block.
+ */
+static void check_forget(block_t *block, size_t size)
+{
+    if (heap->check_cursor > block && (unsigned char *) heap->check_cursor < (unsigned char *) block + size)
+        heap->check_cursor = block;
+}
 
-    if (!heap_start) {
+/* check_heap: checks the heap for correctness; returns true if
+ *               the heap is correct, and false otherwise.
+ */
+static bool check_heap()
+{
+    if (!heap->heap_start) {
         printf("NULL heap list pointer!\n");
         return false;
     }
 
-    block_t *curr = heap_start;
-    block_t *next;
-    block_t *hi = mem_heap_hi();
+    /* Walk the heap in address order */
+    size_t heap_free = 0;
+    bool prev_alloc = true;
+    bool prev_mini = false;
+    block_t *curr;
 
-    while ((next = find_next(curr)) + 1 < hi) {
+    for (curr = heap->heap_start; get_size(curr) > 0; curr = find_next(curr)) {
         word_t hdr = curr->header;
-        word_t ftr = *find_prev_footer(next);
 
-        if (hdr != ftr) {
-            printf(
-                    "Header (0x%016lX) != footer (0x%016lX)\n",
-                    hdr, ftr
-                  );
+        if (get_prev_alloc(curr) != prev_alloc) {
+            printf("Block %p has a stale prev-alloc bit\n", (void *)curr);
+            return false;
+        }
+
+        if (get_prev_mini(curr) != prev_mini) {
+            printf("Block %p has a stale prev-mini bit\n", (void *)curr);
+            return false;
+        }
+
+        if (!get_alloc(curr) && get_size(curr) > mini_block_size) {
+            word_t ftr = *header_to_footer(curr);
+
+            if (extract_size(hdr) != extract_size(ftr) || extract_alloc(ftr)) {
+                printf(
+                        "Header (0x%016lX) != footer (0x%016lX)\n",
+                        hdr, ftr
+                      );
+                return false;
+            }
+        }
+
+        if (((uintptr_t) header_to_payload(curr) % dsize) != 0) {
+            printf("Payload of block %p is not aligned\n", (void *)curr);
             return false;
         }
 
-        curr = next;
+        if (!get_alloc(curr)) {
+            if (!prev_alloc) {
+                printf("Adjacent free blocks at %p escaped coalescing\n", (void *)curr);
+                return false;
+            }
+            heap_free++;
+        }
+        prev_alloc = get_alloc(curr);
+        prev_mini = (get_size(curr) == mini_block_size);
+    }
+
+    if (!get_alloc(curr) || get_prev_alloc(curr) != prev_alloc
+        || get_prev_mini(curr) != prev_mini
+        || (void *)curr != (void *)((char *)mem_region_hi(heap->region) + 1 - wsize)
+        || curr != heap->epilogue) {
+        printf("Bad epilogue header at %p\n", (void *)curr);
+        return false;
+    }
+
+    /* Walk every free list and compare against the heap walk */
+    size_t list_free = 0;
+
+    if (!check_free_lists(heap_free, &list_free))
+        return false;
+
+    if (!check_tree(&list_free))
+        return false;
+
+#ifdef MM_DEFER_COALESCE
+    /* Quick blocks are marked allocated and must be of their list's size */
+    size_t quick_total = 0;
+
+    for (size_t i = 0; i < QUICK_CLASSES; i++) {
+        for (curr = heap->quick_list[i]; curr != NULL; curr = curr->payload.mini_next) {
+            if (!in_heap(curr) || !get_alloc(curr) || get_size(curr) != (i + 1) * dsize) {
+                printf("Bad block %p on quick list %zu\n", (void *)curr, i);
+                return false;
+            }
+            quick_total += get_size(curr);
+            if (quick_total > mem_region_size(heap->region)) {
+                printf("Quick list %zu is longer than the heap (cycle?)\n", i);
+                return false;
+            }
+        }
+    }
+
+    if (quick_total != heap->quick_bytes) {
+        printf("%zu bytes on quick lists but quick_bytes is %zu\n", quick_total, heap->quick_bytes);
+        return false;
+    }
+#endif
+
+    if (list_free != heap_free) {
+        printf("%zu free blocks in the heap but %zu on free lists\n", heap_free, list_free);
+        return false;
     }
 
     return true;
@@ -541,6 +3358,35 @@ static size_t max(size_t x, size_t y)
 }
 
 
+/*
+ * min: returns x if x < y, and y otherwise.
+ */
+static size_t min(size_t x, size_t y)
+{
+    return (x < y) ? x : y;
+}
+
+
+/*
+ * adjust_size: returns the block size needed to hold a payload of size
+ *              bytes, including the header and alignment padding.
+ */
+static size_t adjust_size(size_t size)
+{
+    // Tiny request, fits in a mini block
+    if (size <= wsize)
+        return mini_block_size;
+
+    // Too small block
+    if (size + wsize <= min_block_size)
+        return min_block_size;
+
+    // Round up and adjust to meet alignment requirements; allocated
+    // blocks only carry a header
+    return round_up(size + wsize, dsize);
+}
+
+
 /*
  * round_up: Rounds size up to next multiple of n
  */
@@ -553,10 +3399,19 @@ static size_t round_up(size_t size, size_t n)
 /*
  * pack: returns a header reflecting a specified size and its alloc status.
  *       If the block is allocated, the lowest bit is set to 1, and 0 otherwise.
+ *       If the previous block is allocated, the second bit is set to 1,
+ *       and if it is a mini block, the third bit is set to 1.
  */
-static word_t pack(size_t size, bool alloc)
+static word_t pack(size_t size, bool prev_alloc, bool prev_mini, bool alloc)
 {
-    return alloc ? (size | alloc_mask) : size;
+    word_t word = size;
+    if (alloc)
+        word |= alloc_mask;
+    if (prev_alloc)
+        word |= prev_alloc_mask;
+    if (prev_mini)
+        word |= prev_mini_mask;
+    return word;
 }
 
 
@@ -600,25 +3455,87 @@ static bool get_alloc(block_t *block)
 }
 
 
+/*
+ * extract_prev_alloc: returns the allocation status of the previous block
+ *                     recorded in a given header value.
+ */
+static bool extract_prev_alloc(word_t word)
+{
+    return (bool) (word & prev_alloc_mask);
+}
+
+
+/*
+ * get_prev_alloc: returns true when the block before this one in the heap
+ *                 is allocated, based on the block header's second bit.
+ */
+static bool get_prev_alloc(block_t *block)
+{
+    return extract_prev_alloc(block->header);
+}
+
+
+/*
+ * get_mmap: returns true when the block is a huge block in its own mmap
+ *           region, based on the block header's fourth bit.
+ */
+static bool get_mmap(block_t *block)
+{
+    return (bool) (block->header & mmap_mask);
+}
+
+
+/*
+ * get_prev_mini: returns true when the block before this one in the heap
+ *                is a mini block, based on the block header's third bit.
+ */
+static bool get_prev_mini(block_t *block)
+{
+    return (bool) (block->header & prev_mini_mask);
+}
+
+
+/*
+ * write_next_prev: records the allocation status and mini-ness of block in
+ *                  the prev bits of the next block's header. Called whenever
+ *                  a block changes status or size.
+ */
+static void write_next_prev(block_t *block)
+{
+    block_t *block_next = find_next(block);
+    word_t header = block_next->header & ~(prev_alloc_mask | prev_mini_mask);
+
+    // The next block may be allocated and read by its owner without the
+    // heap lock, so the word is stored in one piece
+    header |= pack(0, get_alloc(block), get_size(block) == mini_block_size, false);
+    __atomic_store_n(&block_next->header, header, __ATOMIC_RELAXED);
+}
+
+
 /*
  * write_header: given a block and its size and allocation status,
  *               writes an appropriate value to the block header.
  */
-static void write_header(block_t *block, size_t size, bool alloc)
+static void write_header(block_t *block, size_t size, bool prev_alloc,
+                         bool prev_mini, bool alloc)
 {
-    block->header = pack(size, alloc);
+    block->header = pack(size, prev_alloc, prev_mini, alloc);
 }
 
 
 /*
  * write_footer: given a block and its size and allocation status,
  *               writes an appropriate value to the block footer by first
- *               computing the position of the footer.
+ *               computing the position of the footer. Only free blocks
+ *               have a footer, and free mini blocks have no room for one.
  */
 static void write_footer(block_t *block, size_t size, bool alloc)
 {
-    word_t *footerp = header_to_footer(block);
-    *footerp = pack(size, alloc);
+    if (size == mini_block_size)
+        return;
+
+    word_t *footerp = (word_t *) (block->payload.data + size - dsize);
+    *footerp = pack(size, false, false, alloc);
 }
 
 
@@ -645,10 +3562,14 @@ static word_t *find_prev_footer(block_t *block)
 /*
  * find_prev: returns the previous block position by checking the previous
  *            block's footer and calculating the start of the previous block
- *            based on its size.
+ *            based on its size. Only valid when the previous block is free;
+ *            a free mini block has no footer, so it is found by its m bit.
  */
 static block_t *find_prev(block_t *block)
 {
+    if (get_prev_mini(block))
+        return (block_t *) ((unsigned char *) block - mini_block_size);
+
     word_t *footerp = find_prev_footer(block);
     size_t size = extract_size(*footerp);
     return (block_t *) ((unsigned char *) block - size);
@@ -0,0 +1,30 @@
+/*
+ * mm.h - interface to the mm.c memory allocator
+ */
+#include <stdio.h>
+
+extern int mm_init (void);
+extern int mm_attach(void);
+extern int mm_checkpoint(void);
+extern void *mm_malloc (size_t size);
+extern void mm_free (void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc (size_t nmemb, size_t size);
+extern int mm_trim (size_t pad);
+extern size_t mm_malloc_batch(size_t size, void **ptrs, size_t n);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern int mm_profile_dump(FILE *fp);
+extern int mm_check_level(int level);
+
+/* extra heaps, independent of the default one and of each other */
+typedef struct mm_heap mm_heap_t;
+
+extern mm_heap_t *mm_heap_create(size_t size);
+extern void mm_heap_destroy(mm_heap_t *h);
+extern void *mm_heap_malloc(mm_heap_t *h, size_t size);
+extern void *mm_heap_calloc(mm_heap_t *h, size_t nmemb, size_t size);
+extern void *mm_heap_realloc(mm_heap_t *h, void *ptr, size_t size);
+extern void mm_heap_free(mm_heap_t *h, void *ptr);
+extern int mm_heap_profile_dump(mm_heap_t *h, FILE *fp);
@@ -0,0 +1,187 @@
+/*
+ * slab.c - object caches for fixed-size objects, layered on mm_malloc
+ *
+ * A cache serves objects of one size. It gets memory from mm_malloc in
+ * slabs that hold many objects packed back to back with no header
+ * between them, so a run of allocations lands in consecutive memory and
+ * each object costs only its own size rounded up to 16 bytes, the
+ * alignment mm_malloc promises, where mm_malloc would also add a header.
+ *
+ *    slab
+ *  +------+-----+-----+-----+-----+-----+---------------+
+ *  | next | obj | obj | obj | obj | obj |  never used   |
+ *  +------+-----+-----+-----+-----+-----+---------------+
+ *                                       ^ top       end ^
+ *
+ * Objects are carved from the newest slab by bumping top. A freed object
+ * goes on the cache's free stack, linked through its first word, and is
+ * handed out again before any new object is carved, so the most recently
+ * freed and likely still cached memory is reused first. Slabs go back to
+ * mm_free only when the cache is destroyed.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mm.h"
+#include "slab.h"
+
+// Alignment of every object (bytes), as for mm_malloc; object sizes are
+// rounded up to it
+static const size_t slab_align = 16;
+
+// Slab header size (bytes), padded to keep objects slab_align aligned
+static const size_t slab_header_size = 16;
+
+// Slabs hold at least this many bytes of objects...
+static const size_t slab_min_bytes = (1 << 14);
+
+// ...and at least this many objects
+static const size_t slab_min_objs = 32;
+
+typedef struct slab slab_t;
+
+struct slab
+{
+    slab_t *next;
+};
+
+struct slab_cache
+{
+    void *free_stack;       // freed objects, linked through their first word
+    char *top;              // next object to carve from the newest slab
+    char *end;              // end of the newest slab
+    slab_t *slabs;          // newest first
+    slab_stats_t stats;
+};
+
+/* Function prototypes for internal helper routines */
+
+static size_t round_up(size_t size, size_t n);
+static bool slab_grow(slab_cache_t *cache);
+
+/*
+ * slab_cache_create - Create an empty cache for objects of obj_size
+ * bytes. Returns NULL if obj_size is 0 or out of memory.
+ */
+slab_cache_t *slab_cache_create(size_t obj_size)
+{
+    if (obj_size == 0 || obj_size > SIZE_MAX / slab_min_objs / 2)
+        return NULL;
+
+    slab_cache_t *cache = mm_malloc(sizeof(slab_cache_t));
+    if (cache == NULL)
+        return NULL;
+
+    obj_size = round_up(obj_size, slab_align);
+
+    size_t objs = slab_min_bytes / obj_size;
+    if (objs < slab_min_objs)
+        objs = slab_min_objs;
+
+    cache->free_stack = NULL;
+    cache->top = cache->end = NULL;
+    cache->slabs = NULL;
+    cache->stats = (slab_stats_t) {
+        .obj_size = obj_size,
+        .objs_per_slab = objs,
+        .bytes = sizeof(slab_cache_t),
+    };
+
+    return cache;
+}
+
+/*
+ * slab_alloc - Allocate one object from the cache. Returns NULL if out of
+ * memory.
+ */
+void *slab_alloc(slab_cache_t *cache)
+{
+    void *obj = cache->free_stack;
+
+    if (obj != NULL) {
+        cache->free_stack = *(void **) obj;
+        cache->stats.cached--;
+    } else {
+        if (cache->top == cache->end && !slab_grow(cache))
+            return NULL;
+        obj = cache->top;
+        cache->top += cache->stats.obj_size;
+    }
+
+    cache->stats.in_use++;
+    cache->stats.allocs++;
+    return obj;
+}
+
+/*
+ * slab_free - Return an object to the cache it came from
+ */
+void slab_free(slab_cache_t *cache, void *obj)
+{
+    if (obj == NULL)
+        return;
+
+    *(void **) obj = cache->free_stack;
+    cache->free_stack = obj;
+
+    cache->stats.cached++;
+    cache->stats.in_use--;
+    cache->stats.frees++;
+}
+
+/*
+ * slab_cache_stats - Copy the cache's counters into *stats
+ */
+void slab_cache_stats(slab_cache_t *cache, slab_stats_t *stats)
+{
+    *stats = cache->stats;
+}
+
+/*
+ * slab_cache_destroy - Release the cache and all of its slabs. Objects
+ * still allocated from it become invalid.
+ */
+void slab_cache_destroy(slab_cache_t *cache)
+{
+    if (cache == NULL)
+        return;
+
+    slab_t *slab = cache->slabs;
+    while (slab != NULL) {
+        slab_t *next = slab->next;
+        mm_free(slab);
+        slab = next;
+    }
+
+    mm_free(cache);
+}
+
+/*
+ * slab_grow - Add a slab to the cache to carve objects from. Returns
+ * false if mm_malloc is out of memory.
+ */
+static bool slab_grow(slab_cache_t *cache)
+{
+    size_t bytes = cache->stats.objs_per_slab * cache->stats.obj_size;
+    slab_t *slab = mm_malloc(slab_header_size + bytes);
+
+    if (slab == NULL)
+        return false;
+
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    cache->top = (char *) slab + slab_header_size;
+    cache->end = cache->top + bytes;
+
+    cache->stats.slabs++;
+    cache->stats.bytes += slab_header_size + bytes;
+    return true;
+}
+
+/*
+ * round_up: Rounds size up to next multiple of n
+ */
+static size_t round_up(size_t size, size_t n)
+{
+    return n * ((size + (n-1)) / n);
+}
@@ -0,0 +1,24 @@
+/*
+ * slab.h - interface to the object caches in slab.c
+ */
+#include <stddef.h>
+
+typedef struct slab_cache slab_cache_t;
+
+/* Counters reported by slab_cache_stats */
+typedef struct {
+    size_t obj_size;        // bytes per object, after rounding
+    size_t objs_per_slab;
+    size_t slabs;           // slabs taken from mm_malloc
+    size_t in_use;          // objects currently allocated
+    size_t cached;          // freed objects waiting for reuse
+    size_t allocs;          // slab_alloc calls served
+    size_t frees;           // slab_free calls
+    size_t bytes;           // memory held by the cache, headers included
+} slab_stats_t;
+
+extern slab_cache_t *slab_cache_create(size_t obj_size);
+extern void *slab_alloc(slab_cache_t *cache);
+extern void slab_free(slab_cache_t *cache, void *obj);
+extern void slab_cache_stats(slab_cache_t *cache, slab_stats_t *stats);
+extern void slab_cache_destroy(slab_cache_t *cache);
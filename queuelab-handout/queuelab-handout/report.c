@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -180,6 +181,143 @@ size_t peak_bytes = 0;
 size_t last_peak_bytes = 0;
 size_t current_bytes = 0;
 
+/*
+  Per-site accounting.  Each tracked allocation is tagged with the
+  return address of its caller, so every call to malloc_or_fail and
+  friends in the source is its own site.  The fun_name passed by the
+  caller is kept as a readable label.  Sites live in a small
+  open-addressed table; once it fills, new sites are charged to the
+  overflow entry in slot 0.  A second table maps each live block to
+  its site, so that the free functions, which only see the pointer,
+  can credit the right site.  Both tables use plain malloc and are not
+  counted in the totals above.
+*/
+#define SITE_BITS 8
+#define SITE_CNT (1 << SITE_BITS)
+/* Number of sites listed by mem_status */
+#define SITE_TOP 8
+
+typedef struct {
+    void *addr;
+    char *label;
+    size_t live_cnt;
+    size_t live_bytes;
+    size_t total_cnt;
+    size_t peak_bytes;
+} site_t;
+
+typedef struct {
+    void *block;
+    size_t site;
+} live_t;
+
+static site_t sites[SITE_CNT] = { { NULL, "(other sites)", 0, 0, 0, 0 } };
+static size_t site_cnt = 1;
+
+static live_t *live_tab = NULL;
+static size_t live_size = 0;
+static size_t live_cnt = 0;
+
+static size_t hash_ptr(void *p, size_t mask) {
+    uint64_t h = (uint64_t) (uintptr_t) p * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (h >> 32) & mask;
+}
+
+/* Find or create the entry for call site addr */
+static size_t site_lookup(void *addr, char *label) {
+    size_t mask = SITE_CNT - 1;
+    size_t i = hash_ptr(addr, mask);
+    while (true) {
+        if (i != 0) {
+            if (sites[i].addr == addr)
+                return i;
+            if (sites[i].addr == NULL)
+                break;
+        }
+        i = (i + 1) & mask;
+    }
+    /* Keep the table at most 3/4 full so probes stay short */
+    if (site_cnt >= SITE_CNT - SITE_CNT / 4)
+        return 0;
+    sites[i].addr = addr;
+    sites[i].label = label;
+    site_cnt++;
+    return i;
+}
+
+static bool live_grow() {
+    size_t new_size = live_size ? 2 * live_size : 1024;
+    live_t *new_tab = calloc(new_size, sizeof(live_t));
+    if (!new_tab)
+        return false;
+    for (size_t i = 0; i < live_size; i++) {
+        if (!live_tab[i].block)
+            continue;
+        size_t j = hash_ptr(live_tab[i].block, new_size - 1);
+        while (new_tab[j].block)
+            j = (j + 1) & (new_size - 1);
+        new_tab[j] = live_tab[i];
+    }
+    free(live_tab);
+    live_tab = new_tab;
+    live_size = new_size;
+    return true;
+}
+
+/* Charge a new block to the call site at addr */
+static void site_alloc(void *addr, char *label, void *b, size_t bytes) {
+    size_t s = site_lookup(addr, label);
+    site_t *st = &sites[s];
+    st->live_cnt++;
+    st->live_bytes += bytes;
+    st->total_cnt++;
+    st->peak_bytes = MAX(st->peak_bytes, st->live_bytes);
+    if (2 * (live_cnt + 1) > live_size && !live_grow()) {
+        /* Table can't grow.  Block stays untracked, so its bytes will
+           remain charged to the site after it is freed */
+        return;
+    }
+    size_t mask = live_size - 1;
+    size_t i = hash_ptr(b, mask);
+    while (live_tab[i].block)
+        i = (i + 1) & mask;
+    live_tab[i].block = b;
+    live_tab[i].site = s;
+    live_cnt++;
+}
+
+/* Credit a freed block back to the site that allocated it */
+static void site_free(void *b, size_t bytes) {
+    if (!b || live_cnt == 0)
+        return;
+    size_t mask = live_size - 1;
+    size_t i = hash_ptr(b, mask);
+    while (live_tab[i].block != b) {
+        if (!live_tab[i].block)
+            return;
+        i = (i + 1) & mask;
+    }
+    site_t *st = &sites[live_tab[i].site];
+    st->live_cnt--;
+    st->live_bytes -= bytes;
+    live_cnt--;
+    /* Backward-shift deletion: pull later entries of the probe run
+       into the hole so lookups never need tombstones */
+    size_t j = i;
+    while (true) {
+        live_tab[i].block = NULL;
+        size_t home;
+        do {
+            j = (j + 1) & mask;
+            if (!live_tab[j].block)
+                return;
+            home = hash_ptr(live_tab[j].block, mask);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        live_tab[i] = live_tab[j];
+        i = j;
+    }
+}
+
 static void check_exceed(size_t new_bytes) {
     size_t limit_bytes = (size_t) mblimit << 20;
     size_t request_bytes = new_bytes + current_bytes;
@@ -201,6 +339,7 @@ void * malloc_or_fail(size_t bytes, char *fun_name) {
     current_bytes += bytes;
     peak_bytes = MAX(peak_bytes, current_bytes);
     last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    site_alloc(__builtin_return_address(0), fun_name, p, bytes);
     return p;
 }
 
@@ -217,6 +356,7 @@ void *calloc_or_fail(size_t cnt, size_t bytes, char *fun_name) {
     current_bytes += cnt * bytes;
     peak_bytes = MAX(peak_bytes, current_bytes);
     last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    site_alloc(__builtin_return_address(0), fun_name, p, cnt * bytes);
 
     return p;
 }
@@ -227,6 +367,8 @@ void * realloc_or_fail(void *old, size_t old_bytes, size_t new_bytes,
                        char *fun_name) {
     if (new_bytes > old_bytes) 
         check_exceed(new_bytes-old_bytes);
+    /* Drop the old block's tag now; old may be gone after realloc */
+    site_free(old, old_bytes);
     void *p = realloc(old, new_bytes);
     if (!p) {
         fail_fun("Realloc returned NULL in %s", fun_name);
@@ -239,6 +381,8 @@ void * realloc_or_fail(void *old, size_t old_bytes, size_t new_bytes,
     last_peak_bytes = MAX(last_peak_bytes, current_bytes);
     free_cnt++;
     free_bytes += old_bytes;
+    /* The block now belongs to the site that resized it */
+    site_alloc(__builtin_return_address(0), fun_name, p, new_bytes);
     return p;
 }
 
@@ -256,6 +400,7 @@ char *strsave_or_fail(char *s, char *fun_name) {
     current_bytes += len+1;
     peak_bytes = MAX(peak_bytes, current_bytes);
     last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    site_alloc(__builtin_return_address(0), fun_name, ss, len+1);
 
     return strcpy(ss, s);
 }
@@ -265,6 +410,7 @@ void free_block(void *b, size_t bytes) {
     if (b == NULL) {
         report_event(MSG_ERROR, "Attempting to free null block");
     }
+    site_free(b, bytes);
     free(b);
     free_cnt++;
     free_bytes += bytes;
@@ -276,6 +422,7 @@ void free_array(void *b, size_t cnt, size_t bytes) {
     if (b == NULL) {
         report_event(MSG_ERROR, "Attempting to free null block");
     }
+    site_free(b, cnt * bytes);
     free(b);
     free_cnt++;
     free_bytes += cnt * bytes;
@@ -302,6 +449,29 @@ void mem_status(FILE *fp) {
             (long unsigned) peak_bytes, 
             (long unsigned) last_peak_bytes,
             (long unsigned) current_bytes);
+    /* Sites holding the most live bytes, largest first */
+    size_t top[SITE_TOP];
+    size_t ntop = 0;
+    for (size_t i = 0; i < SITE_CNT; i++) {
+        if (sites[i].live_bytes == 0)
+            continue;
+        size_t j = ntop < SITE_TOP ? ntop++ : SITE_TOP;
+        while (j > 0 && sites[top[j-1]].live_bytes < sites[i].live_bytes) {
+            if (j < SITE_TOP)
+                top[j] = top[j-1];
+            j--;
+        }
+        if (j < SITE_TOP)
+            top[j] = i;
+    }
+    for (size_t k = 0; k < ntop; k++) {
+        site_t *st = &sites[top[k]];
+        fprintf(fp,
+                "  %-20s %p: live cnt/bytes %lu/%lu, peak bytes %lu, total cnt %lu\n",
+                st->label, st->addr,
+                (long unsigned) st->live_cnt, (long unsigned) st->live_bytes,
+                (long unsigned) st->peak_bytes, (long unsigned) st->total_cnt);
+    }
 }
 
 /* Initialization of timers */